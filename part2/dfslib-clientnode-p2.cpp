@@ -1,3 +1,4 @@
+#include <map>
 #include <regex>
 #include <mutex>
 #include <vector>
@@ -14,8 +15,12 @@
 #include <getopt.h>
 #include <unistd.h>
 #include <limits.h>
+#include <dirent.h>
+#include <future>
+#include <algorithm>
 #include <sys/inotify.h>
 #include <grpcpp/grpcpp.h>
+#include <grpcpp/alarm.h>
 #include <utime.h>
 
 #include "src/dfs-utils.h"
@@ -50,11 +55,50 @@ extern dfs_log_level_e DFS_LOG_LEVEL;
 // message types you are using to indicate
 // a file request and a listing of files from the server.
 //
-using FileRequestType = dfs_service::File;
+using FileRequestType = dfs_service::CallbackRequest;
 using FileListResponseType = dfs_service::Files;
 
-DFSClientNodeP2::DFSClientNodeP2() : DFSClientNode() {}
-DFSClientNodeP2::~DFSClientNodeP2() {}
+DFSClientNodeP2::DFSClientNodeP2() : DFSClientNode(), transfersStopping(false), leasesStopping(false), transferConcurrency(DFS_TRANSFER_CONCURRENCY),
+    largeFileSize(DFS_LARGE_FILE_SIZE), largeFileShare(DFS_LARGE_FILE_SHARE),
+    statsInterval(DFS_STATS_INTERVAL), lastSequence(0), failedAttempts(0),
+    backoffJitter(std::random_device()()), indexChanges(0), syncStateEnabled(false), savedIndexChanges(0), savedSequence(0) {
+    // Labelled by stripe, so the stats can tell where the contention is
+    DFSLockClass& fileLockClass = DFSLockClass::Named("file");
+    for (size_t i = 0; i < DFS_CLIENT_FILE_LOCK_STRIPES; i++) {
+        fileLocks[i].SetLockClass(fileLockClass);
+        fileLocks[i].SetLabel("file-stripe-" + to_string(i));
+    }
+}
+DFSClientNodeP2::~DFSClientNodeP2() {
+    {
+        lock_guard<DFSMutex> lock(leaseMutex);
+        leasesStopping = true;
+        leasesChanged.notify_all();
+    }
+    if (leaseThread.joinable()) {
+        leaseThread.join();
+    }
+    {
+        unique_lock<DFSMutex> lock(transferMutex);
+        transfersStopping = true;
+        transfersStopped.notify_all();
+        for (Transfer* transfer : activeTransfers) {
+            transfer->context.TryCancel();
+            if (transfer->pacer) {
+                transfer->pacer->Cancel();
+            }
+        }
+        // A cancelled transfer still starts a Finish, which the queue must not have shut down for
+        transfersIdle.wait(lock, [this]{ return activeTransfers.empty(); });
+    }
+    transferQueue.Shutdown();
+    for (std::thread& thread : transferThreads) {
+        thread.join();
+    }
+    if (stallThread.joinable()) {
+        stallThread.join();
+    }
+}
 
 grpc::StatusCode DFSClientNodeP2::RequestWriteAccess(const std::string &filename) {
 
@@ -78,6 +122,7 @@ grpc::StatusCode DFSClientNodeP2::RequestWriteAccess(const std::string &filename
 
     ClientContext context;
     context.AddMetadata(ClientIdMetadataKey, ClientId());
+    context.set_deadline(system_clock::now() + milliseconds(deadline_timeout));
 
     File request;
     request.set_name(filename);
@@ -95,6 +140,114 @@ grpc::StatusCode DFSClientNodeP2::RequestWriteAccess(const std::string &filename
 
 }
 
+grpc::StatusCode DFSClientNodeP2::RequestWriteAccess(const std::vector<std::string>& filenames) {
+    ClientContext context;
+    context.AddMetadata(ClientIdMetadataKey, ClientId());
+    context.set_deadline(system_clock::now() + milliseconds(deadline_timeout));
+
+    FileNames request;
+    for (const string& filename : filenames) {
+        request.add_name(filename);
+    }
+
+    WriteLock response;
+
+    Status status = service_stub->AcquireWriteLocks(&context, request, &response);
+    if (!status.ok()) {
+        dfs_log(LL_ERROR) << "Acquire locks failed - message: " << status.error_message() << ", code: " << status_code_str(status.error_code());
+        return status.error_code();
+    }
+    dfs_log(LL_SYSINFO) << "Locked " << filenames.size() << " files - response: " << response.DebugString();
+    for (const string& filename : filenames) {
+        HoldLease(filename, milliseconds(response.lease_ms()));
+    }
+    return StatusCode::OK;
+}
+
+grpc::StatusCode DFSClientNodeP2::RenewWriteAccess(const std::string& filename, std::chrono::milliseconds* length) {
+    ClientContext context;
+    context.AddMetadata(ClientIdMetadataKey, ClientId());
+    context.set_deadline(system_clock::now() + milliseconds(deadline_timeout));
+
+    File request;
+    request.set_name(filename);
+
+    WriteLock response;
+
+    Status status = service_stub->RenewWriteLock(&context, request, &response);
+    if (!status.ok()) {
+        dfs_log(LL_ERROR) << "Renew lock on " << filename << " failed - message: " << status.error_message() << ", code: " << status_code_str(status.error_code());
+        return status.error_code();
+    }
+    dfs_log(LL_DEBUG) << "Renewed lock on " << filename << " - response: " << response.ShortDebugString();
+    *length = milliseconds(response.lease_ms());
+    return StatusCode::OK;
+}
+
+void DFSClientNodeP2::HoldLease(const std::string& filename, std::chrono::milliseconds length) {
+    std::call_once(leaseThreadStarted, [this]{
+        leaseThread = std::thread(&DFSClientNodeP2::HandleLeaseRenewals, this);
+    });
+    lock_guard<DFSMutex> lock(leaseMutex);
+    heldLeases[filename] = {length, chrono::steady_clock::now() + length / 2};
+    leasesChanged.notify_all();
+}
+
+void DFSClientNodeP2::DropLease(const std::string& filename) {
+    lock_guard<DFSMutex> lock(leaseMutex);
+    heldLeases.erase(filename);
+}
+
+void DFSClientNodeP2::HandleLeaseRenewals() {
+    unique_lock<DFSMutex> lock(leaseMutex);
+    while (!leasesStopping) {
+        auto now = chrono::steady_clock::now();
+        auto next = chrono::steady_clock::time_point::max();
+        vector<string> due;
+        for (const auto& held : heldLeases) {
+            if (held.second.due <= now) {
+                due.push_back(held.first);
+            } else {
+                next = min(next, held.second.due);
+            }
+        }
+        if (due.empty()) {
+            if (next == chrono::steady_clock::time_point::max()) {
+                leasesChanged.wait(lock);
+            } else {
+                leasesChanged.wait_until(lock, next);
+            }
+            continue;
+        }
+
+        for (const string& filename : due) {
+            if (leasesStopping) {
+                break;
+            }
+            lock.unlock();
+            milliseconds length(0);
+            StatusCode statusCode = RenewWriteAccess(filename, &length);
+            lock.lock();
+
+            // The work under the lease may have finished while it was renewed
+            auto held = heldLeases.find(filename);
+            if (held == heldLeases.end()) {
+                continue;
+            }
+            if (statusCode == StatusCode::OK) {
+                held->second = {length, chrono::steady_clock::now() + length / 2};
+            } else if (statusCode == StatusCode::NOT_FOUND || statusCode == StatusCode::RESOURCE_EXHAUSTED) {
+                // Lost. The write it was for is refused or goes through unlocked, as it would have
+                // if the lock hadn't been had in the first place
+                heldLeases.erase(held);
+            } else {
+                // Try again while a quarter of the lease may still be left
+                held->second.due = chrono::steady_clock::now() + held->second.length / 4;
+            }
+        }
+    }
+}
+
 grpc::StatusCode DFSClientNodeP2::Store(const std::string &filename) {
 
     //
@@ -122,66 +275,18 @@ grpc::StatusCode DFSClientNodeP2::Store(const std::string &filename) {
     //
     //
 
-    const string& filePath = WrapPath(filename);
-
-    struct stat fs;
-    if (stat(filePath.c_str(), &fs) != 0){
-        dfs_log(LL_ERROR) << "File " << filePath << " does not exist";
-        return StatusCode::NOT_FOUND;
-    }
-
-    StatusCode writeLockCode = this->RequestWriteAccess(filename);
-    if (writeLockCode != StatusCode::OK) {
-        return StatusCode::RESOURCE_EXHAUSTED;
-    }
-
-    ClientContext context;
-    context.AddMetadata(FileNameMetadataKey, filename);
-    context.AddMetadata(ClientIdMetadataKey, ClientId());
-    context.AddMetadata(CheckSumMetadataKey, to_string(dfs_file_checksum(filePath, &crc_table)));
-    context.AddMetadata(MtimeMetadataKey, to_string(static_cast<long>(fs.st_mtime)));
-    context.set_deadline(system_clock::now() + milliseconds(deadline_timeout));
-
-    FileAck response;
+    Touch(filename);
+    lock_guard<DFSMutex> lock(FileLock(filename));
+    return StoreUnderLock(filename);
 
-    int fileSize = fs.st_size;
-
-    unique_ptr<ClientWriter<FileChunk>> resp = service_stub->WriteFile(&context, &response);
-    dfs_log(LL_SYSINFO) << "Storing file " << filePath << "of size " << fileSize;
-    ifstream ifs(filePath);
-    FileChunk chunk;
-    int bytesSent = 0;
-    try {
-        while(!ifs.eof() && bytesSent < fileSize){
-            char buffer[ChunkSize];
-            int bytesToSend = min(fileSize - bytesSent, ChunkSize);
-            ifs.read(buffer, bytesToSend);
-            chunk.set_contents(buffer, bytesToSend);
-            resp->Write(chunk);
-            bytesSent += bytesToSend;
-            dfs_log(LL_SYSINFO) << "Stored " << bytesSent << " of " << fileSize << " bytes";
-        }
-        ifs.close();
-        if (bytesSent != fileSize) {
-            dfs_log(LL_SYSINFO) << "The impossible happened. Sent: " << bytesSent << " File size: " << fileSize;
-            return StatusCode::CANCELLED;
-        }
-    } catch (exception const& e) {
-        dfs_log(LL_ERROR) << "Error while sending file: " << e.what();
-        resp.release();
-        return StatusCode::CANCELLED;
-    }
-    resp->WritesDone();
-    Status status = resp->Finish();
-    if (!status.ok()) {
-        dfs_log(LL_ERROR) << "Store response message: " << status.error_message() << " code: " << status_code_str(status.error_code());
-        if (status.error_code() == StatusCode::INTERNAL) {
-            return StatusCode::CANCELLED;
-        }
-    }
-    dfs_log(LL_SYSINFO) << "Successfully finished storing: " << response.DebugString();
-    return status.error_code();
+}
 
+grpc::StatusCode DFSClientNodeP2::StoreUnderLock(const std::string& filename) {
+    // The stream itself runs on the transfer queue
+    promise<StatusCode> result;
+    future<StatusCode> outcome = result.get_future();
+    StoreAsync(filename, [&result](StatusCode code) { result.set_value(code); });
+    return outcome.get();
 }
 
 
@@ -208,47 +313,525 @@ grpc::StatusCode DFSClientNodeP2::Fetch(const std::string &filename) {
     //
     // Hint: You may want to match the mtime on local files to the server's mtime
     //
-    const string& filePath = WrapPath(filename);
+    Touch(filename);
+    lock_guard<DFSMutex> lock(FileLock(filename));
+    return FetchUnderLock(filename);
 
-    ClientContext context;
-    struct stat fs;
-    if (stat(filePath.c_str(), &fs) == 0){
-        dfs_log(LL_SYSINFO) << "File " << filePath << " found on client. Adding mtime metadata";
+}
+
+grpc::StatusCode DFSClientNodeP2::FetchUnderLock(const std::string& filename) {
+    promise<StatusCode> result;
+    future<StatusCode> outcome = result.get_future();
+    FetchAsync(filename, [&result](StatusCode code) { result.set_value(code); });
+    return outcome.get();
+}
+
+/*
+ * StoreTransfer streams a file to the server. The next chunk is read from disk while the
+ * previous one is on the wire, so the disk and the network are busy at the same time.
+ */
+class DFSClientNodeP2::StoreTransfer : public DFSClientNodeP2::Transfer {
+
+public:
+    StoreTransfer(DFSClientNodeP2* node, const string& filename, TransferDone done) :
+        Transfer(node, filename, std::move(done)), state(STARTING), checksum(0), fileSize(0), bytesRead(0), bytesSent(0), failed(false), locking(false) {}
+
+protected:
+    void Start() override {
+        const string& filePath = node->WrapPath(filename);
+
+        struct stat fs;
+        if (stat(filePath.c_str(), &fs) != 0){
+            node->UnindexLocalFile(filename);
+            dfs_log(LL_ERROR) << "File " << filePath << " does not exist";
+            Complete(StatusCode::NOT_FOUND);
+            return;
+        }
+        node->IndexLocalFile(filename, fs);
+        fileSize = fs.st_size;
+        checksum = dfs_file_checksum(filePath, &node->crc_table);
+
+        // Instead of taking a lock, the write is conditional on the server still having the version
+        // this copy was last synced with. If another client got there first it fails, and the next
+        // sync decides between the two. A client that doesn't know the version, e.g. a one-off
+        // store from the command line, locks the file as part of the call instead
+        context.AddMetadata(FileNameMetadataKey, filename);
+        context.AddMetadata(ClientIdMetadataKey, node->ClientId());
+        google::protobuf::uint64 version;
+        if (node->IndexedVersion(filename, &version)) {
+            context.AddMetadata(ExpectedVersionMetadataKey, to_string(version));
+        } else {
+            context.AddMetadata(AcquireLockMetadataKey, "1");
+            locking = true;
+        }
+        context.AddMetadata(CheckSumMetadataKey, to_string(checksum));
         context.AddMetadata(MtimeMetadataKey, to_string(static_cast<long>(fs.st_mtime)));
+        SetDeadline(node->uploadThrottle);
+
+        if (!node->BeginTransfer(this)) {
+            Complete(StatusCode::CANCELLED);
+            return;
+        }
+        dfs_log(LL_SYSINFO) << "Storing file " << filePath << " of size " << fileSize;
+        ifs.open(filePath, ios::binary);
+        writer = node->service_stub->PrepareAsyncWriteFile(&context, &response, &node->transferQueue);
+        writer->StartCall(this);
+        // Have the first chunk ready by the time the call is
+        ReadAhead();
     }
-    context.set_deadline(system_clock::now() + milliseconds(deadline_timeout));
-    context.AddMetadata(CheckSumMetadataKey, to_string(dfs_file_checksum(filePath, &crc_table)));
 
-    File request;
-    request.set_name(filename);
+    void Proceed(bool ok) override {
+        switch (state) {
+            case STARTING:
+                if (!ok) {
+                    Finish();
+                } else if (locking) {
+                    // The server sends the lease's length once it has the lock, before any contents
+                    state = LEASING;
+                    writer->ReadInitialMetadata(this);
+                } else {
+                    SendNext();
+                }
+                break;
+            case LEASING:
+                if (!ok) {
+                    Finish();
+                } else {
+                    KeepLease();
+                    SendNext();
+                }
+                break;
+            case WRITING:
+                if (!ok) {
+                    // The server has finished the call early, e.g. on a version conflict
+                    Finish();
+                } else {
+                    bytesSent += chunk.contents().size();
+                    dfs_log(LL_DEBUG2) << "Stored " << bytesSent << " of " << fileSize << " bytes";
+                    SendNext();
+                }
+                break;
+            case PACING:
+                if (!ok) {
+                    // Shutting down
+                    failed = true;
+                    context.TryCancel();
+                    Finish();
+                } else {
+                    Write();
+                }
+                break;
+            case WRITES_DONE:
+                Finish();
+                break;
+            case FINISHING:
+                Finished();
+                break;
+        }
+    }
 
-    unique_ptr<ClientReader<FileChunk>> response = service_stub->GetFile(&context, request);
-    ofstream ofs;
+private:
+    enum { STARTING, LEASING, PACING, WRITING, WRITES_DONE, FINISHING } state;
+
+    FileAck response;
+    grpc::Status status;
+    unique_ptr<grpc::ClientAsyncWriter<FileChunk>> writer;
+    ifstream ifs;
+
+    /** The chunk on the wire, and the one read from disk to follow it **/
     FileChunk chunk;
-    try {
-        while (response->Read(&chunk)) {
-            if (!ofs.is_open()){
-                ofs.open(filePath, ios::trunc);
+    FileChunk next;
+
+    /** Of the file as it was when the store started **/
+    std::uint32_t checksum;
+    std::int64_t fileSize;
+    std::int64_t bytesRead;
+    std::int64_t bytesSent;
+    bool failed;
+
+    /** Whether the write locks the file, and the lease must last until it is done **/
+    bool locking;
+
+    void KeepLease() {
+        const multimap<grpc::string_ref, grpc::string_ref>& metadata = context.GetServerInitialMetadata();
+        auto leaseV = metadata.find(LeaseMetadataKey);
+        if (leaseV == metadata.end()) {
+            // Refused, which the rest of the call will report
+            return;
+        }
+        node->HoldLease(filename, milliseconds(stoll(string(leaseV->second.begin(), leaseV->second.end()))));
+    }
+
+    void ReadAhead() {
+        next.clear_contents();
+        std::int64_t bytesToRead = min<std::int64_t>(fileSize - bytesRead, ChunkSize);
+        if (bytesToRead <= 0) {
+            return;
+        }
+        string* contents = next.mutable_contents();
+        contents->resize(bytesToRead);
+        ifs.read(&(*contents)[0], bytesToRead);
+        if (ifs.gcount() != bytesToRead) {
+            // The file shrank under us. A later event will store what it is now
+            dfs_log(LL_ERROR) << "Short read storing " << filename << " at " << bytesRead << " of " << fileSize << " bytes";
+            failed = true;
+            next.clear_contents();
+            return;
+        }
+        bytesRead += bytesToRead;
+    }
+
+    void SendNext() {
+        if (failed) {
+            context.TryCancel();
+            Finish();
+        } else if (next.contents().empty()) {
+            state = WRITES_DONE;
+            writer->WritesDone(this);
+        } else {
+            chunk.Swap(&next);
+            if (Pace(node->uploadThrottle, chunk.contents().size())) {
+                state = PACING;
+            } else {
+                Write();
             }
-            const string& str = chunk.contents();
-            dfs_log(LL_SYSINFO) << "Writing chunk of size " << str.length() << " bytes";
-            ofs << str;
+            ReadAhead();
         }
-        ofs.close();
-    } catch (exception const& e) {
-        dfs_log(LL_ERROR) << "Error writing to file: " << e.what();
-        response.release();
-        return StatusCode::CANCELLED;
     }
-    Status status = response->Finish();
-    if (!status.ok()) {
-        dfs_log(LL_ERROR) << "Fetch response message: " << status.error_message() << " code: " << status_code_str(status.error_code());
-        if (status.error_code() == StatusCode::INTERNAL) {
-            return StatusCode::CANCELLED;
+
+    void Write() {
+        state = WRITING;
+        writer->Write(chunk, this);
+    }
+
+    void Finish() {
+        state = FINISHING;
+        writer->Finish(&status, this);
+    }
+
+    void Finished() {
+        ifs.close();
+        if (locking) {
+            node->DropLease(filename);
+        }
+        if (failed) {
+            Complete(StatusCode::CANCELLED);
+            return;
+        }
+        if (!status.ok()) {
+            dfs_log(LL_ERROR) << "Store response message: " << status.error_message() << " code: " << status_code_str(status.error_code());
+            if (status.error_code() == StatusCode::ALREADY_EXISTS) {
+                // The server already has these contents, at the version it sent back
+                node->SetIndexedVersion(filename, ServerVersion(context.GetServerTrailingMetadata()), checksum);
+            } else if (status.error_code() == StatusCode::FAILED_PRECONDITION) {
+                // Another client published first. Like a refused lock, this write is abandoned
+                Complete(StatusCode::RESOURCE_EXHAUSTED);
+                return;
+            } else if (status.error_code() == StatusCode::INTERNAL) {
+                Complete(StatusCode::CANCELLED);
+                return;
+            }
+            Complete(status.error_code());
+            return;
         }
+        node->SetIndexedVersion(filename, response.version(), checksum);
+        dfs_log(LL_SYSINFO) << "Successfully finished storing: " << response.ShortDebugString();
+        Complete(StatusCode::OK);
     }
-    return status.error_code();
+};
+
+/*
+ * FetchTransfer streams a file from the server into a hidden file beside it, which the
+ * watcher ignores, and renames it into place once the whole file has arrived. Each read is
+ * reissued before the previous chunk is written out, so the disk and the network overlap.
+ */
+class DFSClientNodeP2::FetchTransfer : public DFSClientNodeP2::Transfer {
+
+public:
+    FetchTransfer(DFSClientNodeP2* node, const string& filename, TransferDone done) :
+        Transfer(node, filename, std::move(done)), state(STARTING), localChecksum(0), failed(false) {}
+
+protected:
+    void Start() override {
+        filePath = node->WrapPath(filename);
+        tempPath = node->WrapPath(FetchTempName(filename));
+
+        struct stat fs;
+        if (stat(filePath.c_str(), &fs) == 0){
+            dfs_log(LL_SYSINFO) << "File " << filePath << " found on client. Adding mtime metadata";
+            context.AddMetadata(MtimeMetadataKey, to_string(static_cast<long>(fs.st_mtime)));
+        }
+        SetDeadline(node->downloadThrottle);
+        localChecksum = dfs_file_checksum(filePath, &node->crc_table);
+        context.AddMetadata(CheckSumMetadataKey, to_string(localChecksum));
+
+        if (!node->BeginTransfer(this)) {
+            Complete(StatusCode::CANCELLED);
+            return;
+        }
+        request.set_name(filename);
+        reader = node->service_stub->PrepareAsyncGetFile(&context, request, &node->transferQueue);
+        reader->StartCall(this);
+    }
+
+    void Proceed(bool ok) override {
+        switch (state) {
+            case STARTING:
+            case READING:
+                if (!ok) {
+                    state = FINISHING;
+                    reader->Finish(&status, this);
+                    break;
+                }
+                if (state == READING) {
+                    // Take the chunk and have the next one on its way before touching the disk.
+                    // Holding the next read back past the throttle leaves the server's sends
+                    // waiting on flow control, which paces the stream
+                    string contents;
+                    contents.swap(*chunk.mutable_contents());
+                    if (Pace(node->downloadThrottle, contents.size())) {
+                        state = PACING;
+                    } else {
+                        reader->Read(&chunk, this);
+                    }
+                    WriteOut(contents);
+                } else {
+                    state = READING;
+                    reader->Read(&chunk, this);
+                }
+                break;
+            case PACING:
+                if (!ok) {
+                    // Shutting down
+                    failed = true;
+                    context.TryCancel();
+                    state = FINISHING;
+                    reader->Finish(&status, this);
+                } else {
+                    state = READING;
+                    reader->Read(&chunk, this);
+                }
+                break;
+            case FINISHING:
+                Finished();
+                break;
+        }
+    }
+
+private:
+    enum { STARTING, READING, PACING, FINISHING } state;
 
+    string filePath;
+    string tempPath;
+    File request;
+    FileChunk chunk;
+    grpc::Status status;
+    unique_ptr<grpc::ClientAsyncReader<FileChunk>> reader;
+    ofstream ofs;
+    /** Of the local copy as it was when the fetch started **/
+    std::uint32_t localChecksum;
+    bool failed;
+
+    void WriteOut(const string& contents) {
+        if (failed) {
+            return;
+        }
+        if (!ofs.is_open()) {
+            ofs.open(tempPath, ios::binary | ios::trunc);
+        }
+        dfs_log(LL_DEBUG2) << "Writing chunk of size " << contents.length() << " bytes";
+        if (!ofs.write(contents.data(), contents.size())) {
+            dfs_log(LL_ERROR) << "Error writing to " << tempPath;
+            failed = true;
+            context.TryCancel();
+        }
+    }
+
+    void Finished() {
+        bool opened = ofs.is_open();
+        if (opened) {
+            ofs.close();
+        }
+        if (failed || !status.ok()) {
+            if (opened) {
+                unlink(tempPath.c_str());
+            }
+        }
+        if (failed) {
+            node->ReindexLocalFile(filename);
+            Complete(StatusCode::CANCELLED);
+            return;
+        }
+        if (!status.ok()) {
+            dfs_log(LL_ERROR) << "Fetch response message: " << status.error_message() << " code: " << status_code_str(status.error_code());
+            if (status.error_code() == StatusCode::ALREADY_EXISTS) {
+                // Same contents, so this copy is already the server's current version
+                node->SetIndexedVersion(filename, ServerVersion(context.GetServerInitialMetadata()), localChecksum);
+            } else if (status.error_code() == StatusCode::INTERNAL) {
+                Complete(StatusCode::CANCELLED);
+                return;
+            }
+            Complete(status.error_code());
+            return;
+        }
+        // An empty file arrives as no chunks at all
+        if (!opened) {
+            ofstream(tempPath, ios::binary | ios::trunc);
+        }
+        std::uint32_t fetchedChecksum = dfs_file_checksum(tempPath, &node->crc_table);
+        if (rename(tempPath.c_str(), filePath.c_str()) != 0) {
+            dfs_log(LL_ERROR) << "Moving " << tempPath << " into place failed with: " << strerror(errno);
+            unlink(tempPath.c_str());
+            Complete(StatusCode::CANCELLED);
+            return;
+        }
+        node->ReindexLocalFile(filename);
+        node->SetIndexedVersion(filename, ServerVersion(context.GetServerInitialMetadata()), fetchedChecksum);
+        Complete(StatusCode::OK);
+    }
+};
+
+void DFSClientNodeP2::Transfer::Launch() {
+    bool completed;
+    {
+        lock_guard<mutex> lock(stepMutex);
+        Start();
+        completed = finished;
+    }
+    if (completed) {
+        Retire();
+    }
+}
+
+void DFSClientNodeP2::Transfer::Step(bool ok) {
+    bool completed;
+    {
+        lock_guard<mutex> lock(stepMutex);
+        if (stepDeadline) {
+            lock_guard<DFSMutex> lock(node->transferMutex);
+            lastStep = chrono::steady_clock::now();
+        }
+        Proceed(ok);
+        completed = finished;
+    }
+    if (completed) {
+        Retire();
+    }
+}
+
+void DFSClientNodeP2::Transfer::Complete(StatusCode code) {
+    finished = true;
+    outcome = code;
+    if (code != StatusCode::OK) {
+        // The cancel shows up as CANCELLED, but it was the deadline that ended the transfer
+        lock_guard<DFSMutex> lock(node->transferMutex);
+        if (stalled) {
+            outcome = StatusCode::DEADLINE_EXCEEDED;
+        }
+    }
+}
+
+void DFSClientNodeP2::Transfer::SetDeadline(const Throttle& throttle) {
+    if (throttle.Unlimited()) {
+        context.set_deadline(system_clock::now() + milliseconds(node->deadline_timeout));
+        return;
+    }
+    stepDeadline = true;
+    lastStep = chrono::steady_clock::now();
+}
+
+void DFSClientNodeP2::Transfer::CancelIfStalled(chrono::steady_clock::time_point now) {
+    if (!stepDeadline || stalled || now - lastStep <= milliseconds(node->deadline_timeout)) {
+        return;
+    }
+    dfs_log(LL_ERROR) << "Transfer of " << filename << " made no progress in " << node->deadline_timeout << " milliseconds. Cancelling";
+    stalled = true;
+    context.TryCancel();
+}
+
+bool DFSClientNodeP2::Transfer::Pace(Throttle& throttle, std::size_t bytes) {
+    std::chrono::duration<double> delay = throttle.Delay(bytes);
+    if (delay <= delay.zero()) {
+        return false;
+    }
+    // Set under transferMutex so that shutdown can't miss the alarm when it cancels
+    lock_guard<DFSMutex> lock(node->transferMutex);
+    if (node->transfersStopping) {
+        // Already cancelled, so let the next operation fail straight away
+        return false;
+    }
+    pacer.reset(new grpc::Alarm());
+    pacer->Set(&node->transferQueue, system_clock::now() + std::chrono::duration_cast<system_clock::duration>(delay), this);
+    // Waiting on the throttle isn't stalling. The deadline runs from when the chunk may go
+    lastStep = chrono::steady_clock::now() + std::chrono::duration_cast<chrono::steady_clock::duration>(delay);
+    return true;
+}
+
+void DFSClientNodeP2::Transfer::Retire() {
+    // Nothing is outstanding once it has finished, so nobody else can be looking at it. The
+    // transfer is gone before anyone hears about it, so a caller that was waiting on it can
+    // tear the client down straight away
+    {
+        lock_guard<DFSMutex> lock(node->transferMutex);
+        node->activeTransfers.erase(this);
+        if (node->activeTransfers.empty()) {
+            node->transfersIdle.notify_all();
+        }
+    }
+    TransferDone report = std::move(done);
+    StatusCode code = outcome;
+    delete this;
+    report(code);
+}
+
+bool DFSClientNodeP2::BeginTransfer(Transfer* transfer) {
+    std::call_once(transferThreadsStarted, [this]{
+        for (int i = 0; i < DFS_TRANSFER_QUEUE_THREADS; i++) {
+            transferThreads.emplace_back(&DFSClientNodeP2::HandleTransfers, this);
+        }
+        stallThread = std::thread(&DFSClientNodeP2::HandleStalledTransfers, this);
+    });
+    lock_guard<DFSMutex> lock(transferMutex);
+    if (transfersStopping) {
+        return false;
+    }
+    activeTransfers.insert(transfer);
+    return true;
+}
+
+void DFSClientNodeP2::HandleTransfers() {
+    void* tag;
+    bool ok = false;
+    while (transferQueue.Next(&tag, &ok)) {
+        static_cast<Transfer*>(tag)->Step(ok);
+    }
+}
+
+void DFSClientNodeP2::HandleStalledTransfers() {
+    unique_lock<DFSMutex> lock(transferMutex);
+    while (!transfersStopping) {
+        auto now = chrono::steady_clock::now();
+        for (Transfer* transfer : activeTransfers) {
+            transfer->CancelIfStalled(now);
+        }
+        transfersStopped.wait_for(lock, milliseconds(DFS_TRANSFER_STALL_CHECK));
+    }
+}
+
+void DFSClientNodeP2::StoreAsync(const std::string& filename, TransferDone done) {
+    (new StoreTransfer(this, filename, std::move(done)))->Launch();
+}
+
+void DFSClientNodeP2::FetchAsync(const std::string& filename, TransferDone done) {
+    (new FetchTransfer(this, filename, std::move(done)))->Launch();
+}
+
+DFSMutex& DFSClientNodeP2::FileLock(const std::string& filename) {
+    return fileLocks[hash<string>()(filename) % DFS_CLIENT_FILE_LOCK_STRIPES];
+}
+
+string DFSClientNodeP2::FetchTempName(const string& filename) {
+    return "." + filename + DFS_FETCH_TEMP_SUFFIX;
 }
 
 grpc::StatusCode DFSClientNodeP2::Delete(const std::string &filename) {
@@ -273,14 +856,31 @@ grpc::StatusCode DFSClientNodeP2::Delete(const std::string &filename) {
     //
     //
 
-    StatusCode writeLockCode = this->RequestWriteAccess(filename);
-    if (writeLockCode != StatusCode::OK) {
-        return StatusCode::RESOURCE_EXHAUSTED;
+    Touch(filename);
+    lock_guard<DFSMutex> lock(FileLock(filename));
+
+    google::protobuf::uint64 version;
+    bool versionKnown = IndexedVersion(filename, &version);
+    UnindexLocalFile(filename);
+
+    {
+        lock_guard<DFSMutex> lock(localIndexMutex);
+        if (remoteDeletes.erase(filename)) {
+            dfs_log(LL_DEBUG) << "File " << filename << " was already deleted on the server";
+            return StatusCode::OK;
+        }
     }
 
+    // Only delete the version this client last saw, without taking a lock. Without one to go
+    // on, the file is locked as part of the call
     ClientContext context;
     context.set_deadline(system_clock::now() + milliseconds(deadline_timeout));
     context.AddMetadata(ClientIdMetadataKey, ClientId());
+    if (versionKnown) {
+        context.AddMetadata(ExpectedVersionMetadataKey, to_string(version));
+    } else {
+        context.AddMetadata(AcquireLockMetadataKey, "1");
+    }
 
     File request;
     request.set_name(filename);
@@ -290,7 +890,10 @@ grpc::StatusCode DFSClientNodeP2::Delete(const std::string &filename) {
     Status status = service_stub->DeleteFile(&context, request, &response);
     if (!status.ok()) {
         dfs_log(LL_ERROR) << "Delete failed - message: " << status.error_message() << ", code: " << status_code_str(status.error_code());
-        if (status.error_code() == StatusCode::INTERNAL) {
+        if (status.error_code() == StatusCode::FAILED_PRECONDITION) {
+            // Changed on the server since this client saw it, so the newer version survives
+            return StatusCode::RESOURCE_EXHAUSTED;
+        } else if (status.error_code() == StatusCode::INTERNAL) {
             return StatusCode::CANCELLED;
         }
     }
@@ -384,6 +987,27 @@ grpc::StatusCode DFSClientNodeP2::Stat(const std::string &filename, void* file_s
 
 }
 
+grpc::StatusCode DFSClientNodeP2::ServerStats(bool display) {
+    ClientContext context;
+    context.set_deadline(system_clock::now() + milliseconds(deadline_timeout));
+
+    Empty request;
+    Stats response;
+
+    Status status = service_stub->GetStats(&context, request, &response);
+    if (!status.ok()) {
+        dfs_log(LL_ERROR) << "Stats failed - message: " << status.error_message() << ", code: " << status_code_str(status.error_code());
+        if (status.error_code() == StatusCode::INTERNAL) {
+            return StatusCode::CANCELLED;
+        }
+        return status.error_code();
+    }
+    if (display) {
+        cout << formatStats(response);
+    }
+    return status.error_code();
+}
+
 void DFSClientNodeP2::InotifyWatcherCallback(std::function<void()> callback) {
 
     //
@@ -405,13 +1029,11 @@ void DFSClientNodeP2::InotifyWatcherCallback(std::function<void()> callback) {
     // the async thread when a file event has been signaled?
     //
 
-    dirMutex.lock();
-
+    // Store and Delete take the lock of the file they work on, so a transfer of one file
+    // doesn't hold up the events for every other
     callback();
 
-    dfs_log(LL_SYSINFO) << "InotifyWatcherCallback callback finished. Unlocking";
-
-    dirMutex.unlock();
+    dfs_log(LL_SYSINFO) << "InotifyWatcherCallback callback finished";
 }
 
 //
@@ -482,53 +1104,23 @@ void DFSClientNodeP2::HandleCallbackList() {
                 // Do nothing?
                 //
 
-                dirMutex.lock();
-
-                for (const FileStatus& remoteFs : call_data->reply.file()) {
-                    const string& filePath = WrapPath(remoteFs.name());
-
-                    FileStatus localFs;
-                    StatusCode statusCode;
-                    // If file doesn't exist locally or its modified timestamp is less than the server's, fetch it
-                    if (getStat(filePath, &localFs) != 0) {
-                        dfs_log(LL_SYSINFO) << "File " << remoteFs.name() << " doesn't exist locally. Fetching";
-                        if ((statusCode = this->Fetch(remoteFs.name())) != StatusCode::OK) {
-                            dfs_log(LL_ERROR) << "Fetching file failed: " << status_code_str(statusCode);
-                        }
-                        // Fetch it if local timestamp < remote
-                    } else if (remoteFs.modified() > localFs.modified()) {
-                        dfs_log(LL_SYSINFO) << "File " << remoteFs.name() << " is out of date locally. " << "Remote mtime: " << remoteFs.modified() << " Local mtime: " << localFs.modified() << " Storing";
-                        if ((statusCode = this->Fetch(remoteFs.name())) == StatusCode::ALREADY_EXISTS) {
-                            time_t mtime = TimeUtil::TimestampToTimeT(remoteFs.modified());
-                            struct utimbuf ub;
-                            ub.modtime = mtime ;
-                            if (!utime(filePath.c_str(), &ub)) {
-                                dfs_log(LL_SYSINFO) << "Updated " << filePath << " mtime to " << mtime;
-                            } else {
-                                dfs_log(LL_ERROR) << "Updating mtime for " << filePath << " failed with: " << strerror(errno);
-                            }
-                        } else if (statusCode != StatusCode::OK) {
-                            dfs_log(LL_ERROR) << "Fetching file failed: " << status_code_str(statusCode);
-                        }
-                        // Store it if local timestamp > remote
-                    } else if (localFs.modified() > remoteFs.modified()) {
-                        dfs_log(LL_SYSINFO) << "File " << remoteFs.name() << " is out of date on server. " << "Remote mtime: " << remoteFs.modified() << " Local mtime: " << localFs.modified() << " Storing";
-                        if ((statusCode = this->Store(remoteFs.name())) != StatusCode::OK) {
-                            dfs_log(LL_ERROR) << "Storing file failed: " << status_code_str(statusCode);
-                        }
-                    }
-                }
+                SyncWithListing(call_data->reply);
 
-                dirMutex.unlock();
+                // Ask the server to hold the next callback until something newer than this listing exists
+                lastSequence = call_data->reply.sequence();
+                failedAttempts = 0;
 
             } else {
-                dfs_log(LL_ERROR) << "Status was not ok. Will try again in " << DFS_RESET_TIMEOUT << " milliseconds.";
+                milliseconds backoff = NextBackoff();
+                dfs_log(LL_ERROR) << "Status was not ok. Will try again in " << backoff.count() << " milliseconds.";
                 dfs_log(LL_ERROR) << call_data->status.error_message();
-                std::this_thread::sleep_for(std::chrono::milliseconds(DFS_RESET_TIMEOUT));
+                std::this_thread::sleep_for(backoff);
             }
 
-            // Once we're complete, deallocate the call_data object.
-            delete call_data;
+            // Once we're complete, hand the call_data object back to the pool.
+            AsyncClientData<FileListResponseType>::CallPool().Release(call_data);
+            dfs_log(LL_DEBUG3) << "Callback calls: " << AsyncClientData<FileListResponseType>::CallPool().Acquired()
+                << " made, " << AsyncClientData<FileListResponseType>::CallPool().HeapAllocations() << " from the heap";
 
             //
             // STUDENT INSTRUCTION:
@@ -554,7 +1146,12 @@ void DFSClientNodeP2::HandleCallbackList() {
  * give you a chance to focus more on the project's requirements.
  */
 void DFSClientNodeP2::InitCallbackList() {
-    CallbackList<FileRequestType, FileListResponseType>();
+    FileRequestType request;
+    request.set_name("");
+    request.set_sequence(lastSequence);
+    *request.mutable_filter() = subscriptionFilter;
+    request.set_client_id(ClientId());
+    CallbackList<FileRequestType, FileListResponseType>(request);
 }
 
 //
@@ -563,4 +1160,640 @@ void DFSClientNodeP2::InitCallbackList() {
 // Add any additional code you need to here
 //
 
+milliseconds DFSClientNodeP2::NextBackoff() {
+    long ceiling = DFS_BACKOFF_MAX;
+    if (failedAttempts < 16) {
+        ceiling = std::min<long>(ceiling, static_cast<long>(DFS_BACKOFF_BASE) << failedAttempts);
+    }
+    failedAttempts++;
+    std::uniform_int_distribution<long> jitter(ceiling / 2, ceiling);
+    return milliseconds(jitter(backoffJitter));
+}
+
+void DFSClientNodeP2::SetSubscriptionFilter(const vector<string>& include, const vector<string>& exclude) {
+    subscriptionFilter.Clear();
+    for (const string& pattern : include) {
+        subscriptionFilter.add_include(pattern);
+    }
+    for (const string& pattern : exclude) {
+        subscriptionFilter.add_exclude(pattern);
+    }
+}
+
+void DFSClientNodeP2::SeedLocalIndex() {
+    DIR *dir;
+    if ((dir = opendir(mount_path.c_str())) == NULL) {
+        dfs_log(LL_ERROR) << "Failed to open directory at mount path " << mount_path;
+        return;
+    }
+
+    // What was synced last time, if anything, keyed by name
+    SyncState state;
+    bool resumed = LoadSyncState(&state);
+    map<string, FileStatus*> synced;
+    for (FileStatus& fs : *state.mutable_file()) {
+        synced[fs.name()] = &fs;
+    }
+
+    map<string, FileStatus> seeded;
+    vector<string> stores;
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        struct stat path_stat;
+        string dirEntry(ent->d_name);
+        if (stat(WrapPath(dirEntry).c_str(), &path_stat) != 0 || !S_ISREG(path_stat.st_mode)) {
+            continue;
+        }
+        // Hidden files are never synced. Fetches left half done by a previous run can go
+        if (dirEntry[0] == '.') {
+            const string suffix(DFS_FETCH_TEMP_SUFFIX);
+            if (dirEntry.size() > suffix.size() && dirEntry.compare(dirEntry.size() - suffix.size(), suffix.size(), suffix) == 0) {
+                unlink(WrapPath(dirEntry).c_str());
+            }
+            continue;
+        }
+        FileStatus& fs = seeded[dirEntry];
+        fillFileStatus(path_stat, &fs);
+        fs.set_name(dirEntry);
+
+        auto last = synced.find(dirEntry);
+        if (last == synced.end()) {
+            if (resumed) {
+                stores.push_back(dirEntry);
+            }
+            continue;
+        }
+        const FileStatus& lastFs = *last->second;
+        // An unchanged stat is trusted, and a changed one only costs a checksum when there is one to compare
+        bool unchanged = lastFs.size() == fs.size() && lastFs.modified().seconds() == fs.modified().seconds();
+        if (!unchanged && lastFs.checksum() != 0) {
+            unchanged = dfs_file_checksum(WrapPath(dirEntry), &crc_table) == lastFs.checksum();
+        }
+        // Changed or not, the version is what a store has to be conditional on
+        fs.set_version(lastFs.version());
+        if (unchanged && lastFs.checksum() != 0) {
+            fs.set_checksum(lastFs.checksum());
+        } else {
+            stores.push_back(dirEntry);
+        }
+        synced.erase(last);
+    }
+    closedir(dir);
+
+    // Whatever is left was deleted while the client was away. It stays indexed, at the version
+    // it was synced at, until ReplayOfflineChanges deletes it on the server
+    vector<string> deletes;
+    for (auto& gone : synced) {
+        seeded[gone.first].Swap(gone.second);
+        deletes.push_back(gone.first);
+    }
+
+    {
+        lock_guard<DFSMutex> lock(localIndexMutex);
+        localIndex.swap(seeded);
+        indexChanges++;
+        offlineStores.swap(stores);
+        offlineDeletes.swap(deletes);
+        dfs_log(LL_SYSINFO) << "Seeded local index with " << localIndex.size() << " files";
+    }
+    if (resumed) {
+        lastSequence = state.sequence();
+        dfs_log(LL_SYSINFO) << "Resuming from sequence " << state.sequence() << " with " << offlineStores.size()
+            << " files to store and " << offlineDeletes.size() << " to delete";
+    }
+    syncStateEnabled = true;
+}
+
+void DFSClientNodeP2::ReplayOfflineChanges() {
+    vector<string> stores;
+    vector<string> deletes;
+    {
+        lock_guard<DFSMutex> lock(localIndexMutex);
+        stores.swap(offlineStores);
+        deletes.swap(offlineDeletes);
+    }
+    // Lock the whole set up front, one round trip per batch, so no other client's writes land
+    // in the middle of the replay, and keep the leases renewed until each file's turn is over.
+    // The writes are conditional, so if another client holds a lock on any of the files, the
+    // replay goes ahead unlocked and those files are refused on their own
+    vector<string> names(stores);
+    names.insert(names.end(), deletes.begin(), deletes.end());
+    for (size_t first = 0; first < names.size(); first += DFS_LOCK_BATCH_MAX) {
+        vector<string> batch(names.begin() + first, names.begin() + min<size_t>(first + DFS_LOCK_BATCH_MAX, names.size()));
+        StatusCode statusCode = RequestWriteAccess(batch);
+        if (statusCode != StatusCode::OK) {
+            dfs_log(LL_ERROR) << "Replaying " << batch.size() << " offline changes without locks: " << status_code_str(statusCode);
+        }
+    }
+    for (const string& filename : stores) {
+        Pool().Submit(filename, [this, filename]{
+            StatusCode statusCode = Store(filename);
+            DropLease(filename);
+            if (statusCode != StatusCode::OK && statusCode != StatusCode::ALREADY_EXISTS) {
+                dfs_log(LL_ERROR) << "Storing " << filename << " changed while unmounted failed: " << status_code_str(statusCode);
+            }
+        });
+    }
+    for (const string& filename : deletes) {
+        Pool().Submit(filename, [this, filename]{
+            StatusCode statusCode = Delete(filename);
+            DropLease(filename);
+            if (statusCode != StatusCode::OK && statusCode != StatusCode::NOT_FOUND) {
+                dfs_log(LL_ERROR) << "Deleting " << filename << " deleted while unmounted failed: " << status_code_str(statusCode);
+            }
+        });
+    }
+    Pool().Wait();
+}
+
+bool DFSClientNodeP2::LoadSyncState(SyncState* state) {
+    ifstream ifs(WrapPath(DFS_SYNC_STATE_FILE), ios::binary);
+    if (!ifs.is_open()) {
+        return false;
+    }
+    if (!state->ParseFromIstream(&ifs)) {
+        dfs_log(LL_ERROR) << "Ignoring unreadable sync state " << WrapPath(DFS_SYNC_STATE_FILE);
+        state->Clear();
+        return false;
+    }
+    return true;
+}
+
+void DFSClientNodeP2::SaveSyncState() {
+    if (!syncStateEnabled) {
+        return;
+    }
+    unique_lock<DFSMutex> saveLock(syncStateMutex, try_to_lock);
+    if (!saveLock.owns_lock()) {
+        return;
+    }
+
+    // Taken before the index, so the index saved is at least as new as the sequence
+    google::protobuf::uint64 sequence = lastSequence;
+    google::protobuf::uint64 changes;
+    SyncState state;
+    {
+        unique_lock<DFSMutex> lock(localIndexMutex, try_to_lock);
+        if (!lock.owns_lock() || (indexChanges == savedIndexChanges && sequence == savedSequence)) {
+            return;
+        }
+        changes = indexChanges;
+        state.mutable_file()->Reserve(localIndex.size());
+        for (const auto& entry : localIndex) {
+            *state.add_file() = entry.second;
+        }
+    }
+    state.set_sequence(sequence);
+
+    // Written beside the state and renamed over it, so a crash leaves the old state or the new one
+    const string statePath = WrapPath(DFS_SYNC_STATE_FILE);
+    const string tempPath = statePath + ".tmp";
+    {
+        ofstream ofs(tempPath, ios::binary | ios::trunc);
+        if (!state.SerializeToOstream(&ofs) || !ofs.flush()) {
+            dfs_log(LL_ERROR) << "Writing sync state " << tempPath << " failed";
+            return;
+        }
+    }
+    if (rename(tempPath.c_str(), statePath.c_str()) != 0) {
+        dfs_log(LL_ERROR) << "Saving sync state " << statePath << " failed with: " << strerror(errno);
+        unlink(tempPath.c_str());
+        return;
+    }
+    savedIndexChanges = changes;
+    savedSequence = sequence;
+    dfs_log(LL_DEBUG2) << "Saved sync state of " << state.file_size() << " files at sequence " << sequence;
+}
+
+void DFSClientNodeP2::HandleSyncStateSave() {
+    while (!Unmounting()) {
+        std::this_thread::sleep_for(milliseconds(DFS_SYNC_STATE_INTERVAL));
+        SaveSyncState();
+    }
+}
+
+void DFSClientNodeP2::IndexLocalFile(const std::string& filename, const struct stat& st) {
+    lock_guard<DFSMutex> lock(localIndexMutex);
+    FileStatus& fs = localIndex[filename];
+    // The checksum only vouches for the contents at the stat it was taken with
+    if (fs.size() != static_cast<google::protobuf::uint64>(st.st_size) || fs.modified().seconds() != st.st_mtime) {
+        fs.set_checksum(0);
+    }
+    indexChanges++;
+    fillFileStatus(st, &fs);
+    fs.set_name(filename);
+}
+
+void DFSClientNodeP2::ReindexLocalFile(const std::string& filename) {
+    struct stat st;
+    if (stat(WrapPath(filename).c_str(), &st) != 0) {
+        UnindexLocalFile(filename);
+        return;
+    }
+    IndexLocalFile(filename, st);
+}
+
+void DFSClientNodeP2::UnindexLocalFile(const std::string& filename) {
+    lock_guard<DFSMutex> lock(localIndexMutex);
+    indexChanges++;
+    localIndex.erase(filename);
+}
+
+bool DFSClientNodeP2::IndexedVersion(const std::string& filename, google::protobuf::uint64* version) {
+    // Without a seeded index the client has never seen a listing, so 0 would claim a file the
+    // server may well have doesn't exist
+    if (!syncStateEnabled) {
+        return false;
+    }
+    lock_guard<DFSMutex> lock(localIndexMutex);
+    auto indexed = localIndex.find(filename);
+    *version = indexed == localIndex.end() ? 0 : indexed->second.version();
+    return true;
+}
+
+void DFSClientNodeP2::SetIndexedVersion(const std::string& filename, google::protobuf::uint64 version, std::uint32_t checksum) {
+    lock_guard<DFSMutex> lock(localIndexMutex);
+    auto indexed = localIndex.find(filename);
+    if (indexed != localIndex.end()) {
+        indexed->second.set_version(version);
+        indexed->second.set_checksum(checksum);
+        indexChanges++;
+    }
+}
+
+google::protobuf::uint64 DFSClientNodeP2::ServerVersion(const multimap<grpc::string_ref, grpc::string_ref>& metadata) {
+    auto versionV = metadata.find(VersionMetadataKey);
+    if (versionV == metadata.end()) {
+        return 0;
+    }
+    return stoull(string(versionV->second.begin(), versionV->second.end()));
+}
+
+DFSTransferPool& DFSClientNodeP2::Pool() {
+    if (!transferPool) {
+        transferPool.reset(new DFSTransferPool(transferConcurrency, transferConcurrency * largeFileShare / 100));
+    }
+    return *transferPool;
+}
+
+void DFSClientNodeP2::Touch(const std::string& filename) {
+    lock_guard<DFSMutex> lock(localIndexMutex);
+    touchedFiles[filename] = chrono::steady_clock::now();
+}
+
+bool DFSClientNodeP2::SyncWithListing(const FileListResponseType& listing) {
+    vector<SyncTask> tasks = DiffListing(listing);
+
+    // Files the user worked on lately go first, then the rest smallest first, so a big sync
+    // gets the files people are waiting on, and the most files, done soonest. Large files
+    // take their turn in their own lane
+    const google::protobuf::uint64 untouched = google::protobuf::uint64(1) << 62;
+    vector<pair<google::protobuf::uint64, bool>> ranks;
+    ranks.reserve(tasks.size());
+    {
+        lock_guard<DFSMutex> lock(localIndexMutex);
+        auto now = chrono::steady_clock::now();
+        for (auto touched = touchedFiles.begin(); touched != touchedFiles.end(); ) {
+            touched = now - touched->second > milliseconds(DFS_TOUCHED_WINDOW) ? touchedFiles.erase(touched) : next(touched);
+        }
+        for (const SyncTask& task : tasks) {
+            google::protobuf::uint64 size = task.remote->size();
+            if (task.action == SyncAction::STORE) {
+                auto local = localIndex.find(task.remote->name());
+                size = local == localIndex.end() ? 0 : local->second.size();
+            }
+            bool touched = touchedFiles.count(task.remote->name()) != 0;
+            ranks.emplace_back((touched ? 0 : untouched) + min(size, untouched - 1), !touched && size >= largeFileSize);
+        }
+    }
+
+    // The tasks point into the listing, and at synced, so both have to outlive them
+    std::atomic<bool> synced(true);
+    for (size_t i = 0; i < tasks.size(); i++) {
+        const SyncTask& task = tasks[i];
+        Pool().Submit(task.remote->name(), [this, task, &synced]{
+            if (!RunSyncTask(task)) {
+                synced = false;
+            }
+        }, ranks[i].first, ranks[i].second);
+    }
+    Pool().Wait();
+    return synced;
+}
+
+bool DFSClientNodeP2::SyncSettled(StatusCode code) {
+    return code == StatusCode::OK || code == StatusCode::ALREADY_EXISTS || code == StatusCode::NOT_FOUND
+        || code == StatusCode::RESOURCE_EXHAUSTED;
+}
+
+bool DFSClientNodeP2::RunSyncTask(const SyncTask& listed) {
+    const FileStatus& remoteFs = *listed.remote;
+    lock_guard<DFSMutex> lock(FileLock(remoteFs.name()));
+
+    SyncTask task = listed;
+    if (!RecheckSyncTask(&task)) {
+        dfs_log(LL_DEBUG2) << "File " << remoteFs.name() << " was reconciled while waiting its turn";
+        return true;
+    }
+
+    const string& filePath = WrapPath(remoteFs.name());
+
+    StatusCode statusCode;
+    switch (task.action) {
+        // File doesn't exist locally. Fetch it
+        case SyncAction::FETCH_MISSING:
+            dfs_log(LL_SYSINFO) << "File " << remoteFs.name() << " doesn't exist locally. Fetching";
+            if ((statusCode = FetchUnderLock(remoteFs.name())) != StatusCode::OK) {
+                dfs_log(LL_ERROR) << "Fetching file failed: " << status_code_str(statusCode);
+            }
+            return SyncSettled(statusCode);
+        // Fetch it if local timestamp < remote
+        case SyncAction::FETCH_STALE:
+            dfs_log(LL_SYSINFO) << "File " << remoteFs.name() << " is out of date locally. " << "Remote mtime: " << remoteFs.modified() << " Fetching";
+            if ((statusCode = FetchUnderLock(remoteFs.name())) == StatusCode::ALREADY_EXISTS) {
+                time_t mtime = TimeUtil::TimestampToTimeT(remoteFs.modified());
+                struct utimbuf ub;
+                ub.modtime = mtime ;
+                if (!utime(filePath.c_str(), &ub)) {
+                    dfs_log(LL_SYSINFO) << "Updated " << filePath << " mtime to " << mtime;
+                } else {
+                    dfs_log(LL_ERROR) << "Updating mtime for " << filePath << " failed with: " << strerror(errno);
+                }
+                ReindexLocalFile(remoteFs.name());
+            } else if (statusCode != StatusCode::OK) {
+                dfs_log(LL_ERROR) << "Fetching file failed: " << status_code_str(statusCode);
+            }
+            return SyncSettled(statusCode);
+        // Store it if local timestamp > remote
+        case SyncAction::STORE:
+            dfs_log(LL_SYSINFO) << "File " << remoteFs.name() << " is out of date on server. " << "Remote mtime: " << remoteFs.modified() << " Storing";
+            if ((statusCode = StoreUnderLock(remoteFs.name())) != StatusCode::OK) {
+                dfs_log(LL_ERROR) << "Storing file failed: " << status_code_str(statusCode);
+            }
+            return SyncSettled(statusCode);
+        // Deleted on the server and not changed here since
+        case SyncAction::DELETE_LOCAL:
+            dfs_log(LL_SYSINFO) << "File " << remoteFs.name() << " was deleted on the server. Deleting";
+            {
+                lock_guard<DFSMutex> lock(localIndexMutex);
+                remoteDeletes.insert(remoteFs.name());
+            }
+            if (remove(filePath.c_str()) != 0) {
+                int error = errno;
+                dfs_log(LL_ERROR) << "Deleting " << filePath << " failed with: " << strerror(error);
+                {
+                    lock_guard<DFSMutex> lock(localIndexMutex);
+                    remoteDeletes.erase(remoteFs.name());
+                }
+                if (error != ENOENT) {
+                    return false;
+                }
+            }
+            UnindexLocalFile(remoteFs.name());
+            return true;
+    }
+    return true;
+}
+
+void DFSClientNodeP2::SetTransferConcurrency(int concurrency) {
+    transferConcurrency = concurrency;
+}
+
+void DFSClientNodeP2::SetLargeFileLane(google::protobuf::uint64 size, int share) {
+    largeFileSize = size;
+    largeFileShare = share;
+}
+
+void DFSClientNodeP2::SetThrottle(const RateSchedule& upload, const RateSchedule& download, double burst) {
+    uploadThrottle.Configure(upload, burst);
+    downloadThrottle.Configure(download, burst);
+}
+
+void DFSClientNodeP2::SetStatsInterval(int interval) {
+    statsInterval = milliseconds(interval);
+}
+
+void DFSClientNodeP2::HandleStatsDump() {
+    while (!Unmounting()) {
+        std::this_thread::sleep_for(statsInterval);
+
+        Stats stats;
+        fillLockStats(&stats);
+        auto add = [&stats](const string& name, google::protobuf::uint64 value) {
+            Counter* counter = stats.add_counter();
+            counter->set_name(name);
+            counter->set_value(value);
+        };
+        add("callback_calls_made", AsyncClientData<FileListResponseType>::CallPool().Acquired());
+        add("callback_calls_from_heap", AsyncClientData<FileListResponseType>::CallPool().HeapAllocations());
+        {
+            lock_guard<DFSMutex> lock(localIndexMutex);
+            add("indexed_files", localIndex.size());
+        }
+        dfs_log(LL_SYSINFO) << "Stats:\n" << formatStats(stats);
+    }
+}
+
+void DFSClientNodeP2::HandleSubscription() {
+    while (!Unmounting()) {
+        ClientContext context;
+        SubscribeRequest request;
+        request.set_sequence(lastSequence);
+        *request.mutable_filter() = subscriptionFilter;
+        request.set_client_id(ClientId());
+
+        // A half-open connection delivers nothing, heartbeats included, so a stream that goes
+        // DFS_HEARTBEAT_MISSES intervals without a message while it is being read is given up on.
+        // Applying an event can take as long as it takes
+        std::mutex aliveMutex;
+        std::condition_variable aliveChanged;
+        bool reading = true;
+        bool ended = false;
+        auto readSince = chrono::steady_clock::now();
+        std::thread watchdog([&]{
+            unique_lock<std::mutex> lock(aliveMutex);
+            while (!ended) {
+                auto giveUp = readSince + milliseconds(DFS_HEARTBEAT_INTERVAL * DFS_HEARTBEAT_MISSES);
+                if (reading && chrono::steady_clock::now() >= giveUp) {
+                    dfs_log(LL_ERROR) << "Nothing heard on the subscription for " << DFS_HEARTBEAT_INTERVAL * DFS_HEARTBEAT_MISSES
+                        << " milliseconds. Reconnecting";
+                    context.TryCancel();
+                    break;
+                }
+                if (reading) {
+                    aliveChanged.wait_until(lock, giveUp);
+                } else {
+                    aliveChanged.wait(lock);
+                }
+            }
+        });
+        auto setReading = [&](bool now) {
+            lock_guard<std::mutex> lock(aliveMutex);
+            reading = now;
+            readSince = chrono::steady_clock::now();
+            aliveChanged.notify_one();
+        };
+
+        unique_ptr<ClientReader<ChangeEvent>> reader = service_stub->Subscribe(&context, request);
+        ChangeEvent event;
+        while (reader->Read(&event)) {
+            setReading(false);
+            if (!ApplyChangeEvent(event)) {
+                // Moving the cursor on would skip whatever the event stood for, so start over from it
+                context.TryCancel();
+                break;
+            }
+            lastSequence = event.sequence();
+            failedAttempts = 0;
+            setReading(true);
+        }
+        {
+            lock_guard<std::mutex> lock(aliveMutex);
+            ended = true;
+            aliveChanged.notify_one();
+        }
+        watchdog.join();
+        Status status = reader->Finish();
+        milliseconds backoff = NextBackoff();
+        dfs_log(LL_ERROR) << "Subscription ended - message: " << status.error_message() << ", code: " << status_code_str(status.error_code())
+            << ". Will resume from " << lastSequence << " in " << backoff.count() << " milliseconds.";
+        std::this_thread::sleep_for(backoff);
+    }
+}
+
+bool DFSClientNodeP2::ApplyChangeEvent(const ChangeEvent& event) {
+    dfs_log(LL_DEBUG2) << "Change event: " << event.ShortDebugString();
+
+    Files listing;
+    switch (event.type()) {
+        case ChangeEvent::HEARTBEAT:
+            return true;
+        case ChangeEvent::RESYNC: {
+            // The server can't replay what we missed, so reconcile against a full listing
+            ClientContext context;
+            context.set_deadline(system_clock::now() + milliseconds(deadline_timeout));
+            FileRequestType request;
+            *request.mutable_filter() = subscriptionFilter;
+            // Lets the server count this listing against the RESYNC it sent instead of admitting it again
+            request.set_client_id(ClientId());
+            Status status = service_stub->CallbackList(&context, request, &listing);
+            if (!status.ok()) {
+                dfs_log(LL_ERROR) << "Resync listing failed - message: " << status.error_message() << ", code: " << status_code_str(status.error_code());
+                return false;
+            }
+            break;
+        }
+        case ChangeEvent::DELETED: {
+            FileStatus* fs = listing.add_deleted();
+            fs->set_name(event.name());
+            *fs->mutable_modified() = event.modified();
+            break;
+        }
+        case ChangeEvent::CREATED:
+        case ChangeEvent::MODIFIED:
+        case ChangeEvent::RENAMED: {
+            FileStatus* fs = listing.add_file();
+            fs->set_name(event.name());
+            fs->set_size(event.size());
+            fs->set_version(event.version());
+            *fs->mutable_modified() = event.modified();
+            break;
+        }
+        default:
+            dfs_log(LL_ERROR) << "Unknown change event type " << event.type();
+            return true;
+    }
+    return SyncWithListing(listing);
+}
+
+/*
+ * DiffListing sort-merges a server listing against the local index and returns the
+ * transfers needed to reconcile them. Files that are unchanged on both sides cost a
+ * string comparison, not a syscall.
+ */
+vector<DFSClientNodeP2::SyncTask> DFSClientNodeP2::DiffListing(const FileListResponseType& listing) {
+    vector<const FileStatus*> remote;
+    remote.reserve(listing.file_size());
+    for (const FileStatus& remoteFs : listing.file()) {
+        remote.push_back(&remoteFs);
+    }
+    sort(remote.begin(), remote.end(), [](const FileStatus* a, const FileStatus* b) { return a->name() < b->name(); });
+
+    vector<SyncTask> tasks;
+    lock_guard<DFSMutex> lock(localIndexMutex);
+    auto local = localIndex.cbegin();
+    for (const FileStatus* remoteFs : remote) {
+        // Only seek when the index is behind the listing, so a short listing doesn't walk the whole index
+        if (local != localIndex.cend() && local->first < remoteFs->name()) {
+            local = localIndex.lower_bound(remoteFs->name());
+        }
+        bool indexed = local != localIndex.cend() && local->first == remoteFs->name();
+        SyncAction action;
+        if (ChooseSyncAction(*remoteFs, indexed ? &local->second : nullptr, &action)) {
+            tasks.push_back({action, remoteFs});
+        }
+        if (indexed) {
+            ++local;
+        }
+    }
+
+    // A tombstone only wins over a local copy that hasn't changed since the delete
+    for (const FileStatus& deleted : listing.deleted()) {
+        auto indexed = localIndex.find(deleted.name());
+        if (indexed != localIndex.end() && !(indexed->second.modified() > deleted.modified())) {
+            tasks.push_back({SyncAction::DELETE_LOCAL, &deleted});
+        }
+    }
+    return tasks;
+}
 
+bool DFSClientNodeP2::ChooseSyncAction(const FileStatus& remote, const FileStatus* local, SyncAction* action) {
+    if (local == nullptr) {
+        *action = SyncAction::FETCH_MISSING;
+        return true;
+    }
+    // Versions only go up, so a listing taken before this client's own last transfer of the
+    // file has nothing new to say about it
+    if (remote.version() < local->version()) {
+        return false;
+    }
+    // A checksum means the local copy hasn't changed since it was synced at its version
+    if (remote.version() == local->version() && local->checksum() != 0) {
+        return false;
+    }
+    // Versions catch server changes that mtimes, at a second's resolution, can't. The mtimes
+    // still decide which side wins when both have changed
+    if (local->modified() > remote.modified()) {
+        *action = SyncAction::STORE;
+        return true;
+    }
+    // The server still has the version last synced here. Its mtime is when that was
+    // published, which can be later than the local copy's without anything having changed
+    if (remote.version() == local->version() && local->version() != 0) {
+        return false;
+    }
+    if (remote.modified() > local->modified() || remote.version() != local->version()) {
+        *action = SyncAction::FETCH_STALE;
+        return true;
+    }
+    return false;
+}
+
+bool DFSClientNodeP2::RecheckSyncTask(SyncTask* task) {
+    const FileStatus& remoteFs = *task->remote;
+    lock_guard<DFSMutex> lock(localIndexMutex);
+    auto local = localIndex.find(remoteFs.name());
+    if (task->action == SyncAction::DELETE_LOCAL) {
+        // A tombstone only wins over a local copy that hasn't changed since the delete
+        return local != localIndex.end() && !(local->second.modified() > remoteFs.modified());
+    }
+    if (!ChooseSyncAction(remoteFs, local == localIndex.end() ? nullptr : &local->second, &task->action)) {
+        return false;
+    }
+    if (task->action == SyncAction::STORE) {
+        // Knowingly overwrite the server's version with the newer local one
+        local->second.set_version(remoteFs.version());
+        indexChanges++;
+    }
+    return true;
+}
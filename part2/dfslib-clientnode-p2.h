@@ -4,13 +4,23 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <set>
 #include <limits.h>
 #include <chrono>
 #include <mutex>
+#include <atomic>
+#include <random>
+#include <thread>
+#include <functional>
+#include <condition_variable>
+#include <sys/stat.h>
 
 #include <grpcpp/grpcpp.h>
+#include <grpcpp/alarm.h>
 
 #include "src/dfslibx-clientnode-p2.h"
+#include "src/dfslibx-lock-stats.h"
+#include "src/dfslibx-transfer-pool.h"
 #include "proto-src/dfs-service.grpc.pb.h"
 
 //using std::shared_timed_mutex;
@@ -46,6 +56,16 @@ public:
      */
     grpc::StatusCode RequestWriteAccess(const std::string& filename) override ;
 
+    /**
+     * Request write access to a set of files in one call. Either every file is locked
+     * or, if another client holds a lock on any of them, none is. The leases taken are
+     * renewed until each file is passed to DropLease
+     *
+     * @param filenames
+     * @return grpc::StatusCode, RESOURCE_EXHAUSTED if a lock is held elsewhere
+     */
+    grpc::StatusCode RequestWriteAccess(const std::vector<std::string>& filenames);
+
     /**
      * Store a file from the mount path on to the RPC server
      *
@@ -144,8 +164,541 @@ public:
     // You may add any additional declarations of methods or variables that you need here.
     //
 
+    /**
+     * Populate the in-memory index of the mount path with a single
+     * directory scan. Should be called once before the watcher and
+     * callback threads start; afterwards the index is kept current by
+     * the inotify events and by the client's own transfers.
+     *
+     * If the mount has a saved sync state, files whose stat still matches it
+     * keep the version they were synced at, the client resumes from the saved
+     * sequence, and files changed, created or deleted while it was away are
+     * noted for ReplayOfflineChanges.
+     */
+    void SeedLocalIndex();
+
+    /**
+     * Push the local changes SeedLocalIndex found were made since the sync state was
+     * saved. Call once the index is seeded and before the callback or subscription
+     * thread starts, since with a saved sequence the server only reports its own changes.
+     * The files are locked on the server in batches first, so the replay lands as one commit,
+     * and each lease is renewed until its file's change has been pushed
+     */
+    void ReplayOfflineChanges();
+
+    /**
+     * Write the sync state to the mount if it has changed since it was last written.
+     * Does nothing for a client that hasn't seeded a mount, and skips a save rather
+     * than wait for the index, so it can be called while unmounting
+     */
+    void SaveSyncState();
+
+    /**
+     * Save the sync state every DFS_SYNC_STATE_INTERVAL until the client unmounts
+     */
+    void HandleSyncStateSave();
+
+    /**
+     * Follow the server's Subscribe stream, applying each change event as it
+     * arrives and reconnecting from the last applied sequence when the stream
+     * drops. An alternative to the CallbackList loop for mounts that want
+     * notification cost independent of the namespace size.
+     */
+    void HandleSubscription();
+
+    /**
+     * Limit the changes this client is told about to the files matching the given
+     * patterns. Must be called before the callback or subscription thread starts
+     *
+     * @param include
+     * @param exclude
+     */
+    void SetSubscriptionFilter(const std::vector<std::string>& include, const std::vector<std::string>& exclude);
+
+    /**
+     * Fetch the server's lock contention and queue stats
+     *
+     * @param display print them to stdout
+     * @return grpc::StatusCode
+     */
+    grpc::StatusCode ServerStats(bool display = false);
+
+    /**
+     * Log this client's own lock stats every interval until the client unmounts
+     */
+    void HandleStatsDump();
+
+    /**
+     * How often HandleStatsDump logs, in milliseconds
+     *
+     * @param interval
+     */
+    void SetStatsInterval(int interval);
+
+    /**
+     * How many transfers a sync runs at once. Must be called before the callback or
+     * subscription thread starts
+     *
+     * @param concurrency
+     */
+    void SetTransferConcurrency(int concurrency);
+
+    /**
+     * Which files sync in the large file lane, and how many of the transfer workers it gets.
+     * Must be called before the callback or subscription thread starts
+     *
+     * @param size files at least this many bytes are large
+     * @param share the percentage of the workers that may be busy with large files at once
+     */
+    void SetLargeFileLane(google::protobuf::uint64 size, int share);
+
+    /**
+     * Limit how fast Store and Fetch move file contents. Concurrent transfers in one direction
+     * share its limit. Must be called before the first transfer starts
+     *
+     * @param upload
+     * @param download
+     * @param burst bytes each direction may move at full speed after a lull
+     */
+    void SetThrottle(const RateSchedule& upload, const RateSchedule& download, double burst);
+
+    /** Called with the outcome of an asynchronous transfer, on a transfer queue thread **/
+    using TransferDone = std::function<void(grpc::StatusCode)>;
+
+    /**
+     * Start storing a file on the server without waiting for it. Store returns the same codes
+     *
+     * @param filename
+     * @param done called once the transfer has finished, on the calling thread if it fails to start
+     */
+    void StoreAsync(const std::string& filename, TransferDone done);
+
+    /**
+     * Start fetching a file from the server without waiting for it. Fetch returns the same codes
+     *
+     * @param filename
+     * @param done called once the transfer has finished, on the calling thread if it fails to start
+     */
+    void FetchAsync(const std::string& filename, TransferDone done);
+
 private:
-    mutable std::mutex dirMutex;
+    /**
+     * A Store or Fetch stream in flight on the transfer queue. It is the tag of every operation
+     * it starts, and each completion advances it a step until it completes and is deleted.
+     *
+     * A transfer only ever has one operation outstanding, but that operation can complete on
+     * another queue thread while the thread that started it is still busy, e.g. reading ahead
+     * from disk, so every step runs under the transfer's own mutex
+     */
+    class Transfer {
+    public:
+        explicit Transfer(DFSClientNodeP2* node, const std::string& filename, TransferDone done) :
+            node(node), filename(filename), done(std::move(done)), stepDeadline(false), stalled(false), finished(false) {}
+        virtual ~Transfer() {}
+
+        /** Start the transfer, deleting it if it completes without getting going **/
+        void Launch();
+
+        /**
+         * Advance the transfer on a completion, deleting it once it has completed
+         *
+         * @param ok as reported by the completion queue
+         */
+        void Step(bool ok);
+
+        grpc::ClientContext context;
+
+        /** Wakes the transfer when a paced chunk may go. Guarded by the node's transferMutex **/
+        std::unique_ptr<grpc::Alarm> pacer;
+
+        /**
+         * Cancel a throttled transfer that has gone the deadline timeout without a step, other
+         * than waiting out its pacing. Must be called with the node's transferMutex held
+         *
+         * @param now
+         */
+        void CancelIfStalled(std::chrono::steady_clock::time_point now);
+
+    protected:
+        DFSClientNodeP2* node;
+        std::string filename;
+        TransferDone done;
+
+        virtual void Start() = 0;
+
+        /**
+         * Handle the completion of the operation last started
+         *
+         * @param ok
+         */
+        virtual void Proceed(bool ok) = 0;
+
+        /** Record the outcome, reported once the step is over. The transfer must not start anything afterwards **/
+        void Complete(grpc::StatusCode code);
+
+        /**
+         * Give the stream the deadline timeout. A throttled stream can take far longer than that
+         * to finish, so it gets the timeout for each step instead. Call before the transfer begins
+         *
+         * @param throttle the throttle pacing the stream
+         */
+        void SetDeadline(const Throttle& throttle);
+
+        /**
+         * Hold the next step back if moving a chunk now would exceed the throttle. When it
+         * does, the transfer is stepped with ok once the chunk may go, or without once the
+         * client shuts down
+         *
+         * @param throttle
+         * @param bytes in the chunk
+         * @return true if the transfer now waits to be stepped, false to go ahead now
+         */
+        bool Pace(Throttle& throttle, std::size_t bytes);
+
+    private:
+        std::mutex stepMutex;
+
+        /**
+         * Whether the deadline is per step, fixed before the transfer begins. Then when the last
+         * step was, or when a paced one may go, and whether the transfer was cancelled for
+         * stalling, both guarded by the node's transferMutex
+         */
+        bool stepDeadline;
+        std::chrono::steady_clock::time_point lastStep;
+        bool stalled;
+
+        bool finished;
+        grpc::StatusCode outcome;
+
+        /** Delete the completed transfer and report its outcome **/
+        void Retire();
+    };
+
+    class StoreTransfer;
+    class FetchTransfer;
+
+    /** Pace the contents of every Store and of every Fetch respectively **/
+    Throttle uploadThrottle;
+    Throttle downloadThrottle;
+
+    /** Every Store and Fetch stream is driven from here **/
+    grpc::CompletionQueue transferQueue;
+
+    std::vector<std::thread> transferThreads;
+    std::once_flag transferThreadsStarted;
+
+    /** Transfers in flight, so they can be cancelled on shutdown. Guarded by transferMutex **/
+    std::set<Transfer*> activeTransfers;
+    bool transfersStopping;
+    DFSMutex transferMutex{DFSLockClass::Named("transfers")};
+
+    /** Signalled when the last active transfer retires **/
+    std::condition_variable_any transfersIdle;
+
+    /** Cancels throttled transfers that stall, until the client shuts down **/
+    std::thread stallThread;
+    std::condition_variable_any transfersStopped;
+
+    /** Check the active transfers for stalls every DFS_TRANSFER_STALL_CHECK until shutdown **/
+    void HandleStalledTransfers();
+
+    /** A write lease still needed, and when it is next renewed **/
+    struct HeldLease {
+        std::chrono::milliseconds length;
+        std::chrono::steady_clock::time_point due;
+    };
+
+    /** Leases kept alive by the lease thread, by file name. Guarded by leaseMutex **/
+    std::map<std::string, HeldLease> heldLeases;
+    bool leasesStopping;
+    DFSMutex leaseMutex{DFSLockClass::Named("leases")};
+    std::condition_variable_any leasesChanged;
+    std::thread leaseThread;
+    std::once_flag leaseThreadStarted;
+
+    /**
+     * Keep renewing the lease on a file, at half its length, until DropLease. For work that
+     * can outlast the lease, like a replay waiting its turn in the pool or a throttled upload
+     *
+     * @param filename
+     * @param length of the lease the server granted
+     */
+    void HoldLease(const std::string& filename, std::chrono::milliseconds length);
+
+    /**
+     * Stop renewing the lease on a file, e.g. once the write it covered is done
+     *
+     * @param filename
+     */
+    void DropLease(const std::string& filename);
+
+    /** Renew the held leases as they fall due, until shutdown **/
+    void HandleLeaseRenewals();
+
+    /**
+     * Extend this client's lease on a file
+     *
+     * @param filename
+     * @param length set to the length of the renewed lease
+     * @return grpc::StatusCode, NOT_FOUND if the lease has lapsed and RESOURCE_EXHAUSTED if another client holds the lock
+     */
+    grpc::StatusCode RenewWriteAccess(const std::string& filename, std::chrono::milliseconds* length);
+
+    /**
+     * Track a transfer about to start, starting the transfer threads on first use
+     *
+     * @param transfer
+     * @return false if the client is shutting down and the transfer mustn't start
+     */
+    bool BeginTransfer(Transfer* transfer);
+
+    /** Run transfer queue completions until the queue shuts down **/
+    void HandleTransfers();
+
+    /**
+     * The hidden name a file is fetched under before it is renamed into place
+     *
+     * @param filename
+     * @return the name
+     */
+    static std::string FetchTempName(const std::string& filename);
+
+    /**
+     * Per-file locks, striped by file name. Store, Fetch and Delete, whether called by the
+     * watcher or the command line, and each sync step hold the file's stripe throughout, so
+     * operations on one file never overlap while operations on different files run freely
+     */
+    DFSMutex fileLocks[DFS_CLIENT_FILE_LOCK_STRIPES];
+
+    /**
+     * The lock guarding a file
+     *
+     * @param filename
+     * @return the file's stripe
+     */
+    DFSMutex& FileLock(const std::string& filename);
+
+    /**
+     * Store, with the file's lock already held
+     *
+     * @param filename
+     * @return grpc::StatusCode as for Store
+     */
+    grpc::StatusCode StoreUnderLock(const std::string& filename);
+
+    /**
+     * Fetch, with the file's lock already held
+     *
+     * @param filename
+     * @return grpc::StatusCode as for Fetch
+     */
+    grpc::StatusCode FetchUnderLock(const std::string& filename);
+
+    /** How many workers the transfer pool gets **/
+    int transferConcurrency;
+
+    /** Files at least this big go in the large file lane, which gets this percentage of the workers **/
+    google::protobuf::uint64 largeFileSize;
+    int largeFileShare;
+
+    /** Runs the transfers of a sync, one file at a time per file. Created by the first sync **/
+    std::unique_ptr<DFSTransferPool> transferPool;
+
+    /** How often HandleStatsDump logs **/
+    std::chrono::milliseconds statsInterval;
+
+    /** The server change sequence of the last listing synced by the callback thread **/
+    std::atomic<google::protobuf::uint64> lastSequence;
+
+    /** Consecutive failed attempts to reach the server, for backing off **/
+    unsigned int failedAttempts;
+
+    /** Spreads out the reconnects of clients that lost the server at the same moment **/
+    std::mt19937 backoffJitter;
+
+    /**
+     * Count a failed attempt to reach the server and pick how long to wait before the next one.
+     * The delay doubles with each failure up to DFS_BACKOFF_MAX, and a random half of it is
+     * dropped so clients that failed together don't retry together
+     *
+     * @return the delay
+     */
+    std::chrono::milliseconds NextBackoff();
+
+    /** The files this client wants to hear about, sent with every CallbackList and Subscribe **/
+    dfs_service::SubscriptionFilter subscriptionFilter;
+
+    /** The transfer needed to reconcile a single file with the server **/
+    enum class SyncAction { FETCH_MISSING, FETCH_STALE, STORE, DELETE_LOCAL };
+
+    /** A single reconciliation step produced by DiffListing **/
+    struct SyncTask {
+        SyncAction action;
+        const dfs_service::FileStatus* remote;
+    };
+
+    /**
+     * Diff a server listing against the local index
+     *
+     * @param listing
+     * @return the transfers needed, in file name order
+     */
+    std::vector<SyncTask> DiffListing(const dfs_service::Files& listing);
+
+    /**
+     * Decide what reconciling one listed file with its local index entry takes
+     *
+     * @param remote
+     * @param local the index entry, or nullptr if the file isn't indexed
+     * @param action set to the transfer needed
+     * @return false if the two already agree
+     */
+    static bool ChooseSyncAction(const dfs_service::FileStatus& remote, const dfs_service::FileStatus* local, SyncAction* action);
+
+    /**
+     * Decide a task again against the local index as it is now. The listing was diffed before
+     * the file was locked, and a transfer of the same file may have finished since, so the
+     * original decision could undo a newer local change. Call with the file's lock held
+     *
+     * @param task updated to the transfer still needed
+     * @return false if nothing needs doing any more
+     */
+    bool RecheckSyncTask(SyncTask* task);
+
+    /**
+     * Reconcile the mount with a server listing, which may be a full listing or a single changed file.
+     * The transfers run on the transfer pool, and this returns once they have all finished
+     *
+     * @param listing
+     * @return false if any step failed in a way that trying again could fix
+     */
+    bool SyncWithListing(const dfs_service::Files& listing);
+
+    /**
+     * Carry out one reconciliation step
+     *
+     * @param task
+     * @return false if it failed in a way that trying again could fix
+     */
+    bool RunSyncTask(const SyncTask& task);
+
+    /**
+     * Whether a sync step that ended with a code is done with. A conflict, or a file the server
+     * no longer has, is settled by the change that caused it, which is reported separately
+     *
+     * @param code
+     * @return bool
+     */
+    static bool SyncSettled(grpc::StatusCode code);
+
+    /**
+     * Apply a single event from the Subscribe stream
+     *
+     * @param event
+     * @return false if it couldn't be applied, e.g. the listing for a RESYNC or a transfer
+     *         failed, and the stream must be resumed from before it
+     */
+    bool ApplyChangeEvent(const dfs_service::ChangeEvent& event);
+
+    /**
+     * In-memory index of the mount path keyed (and therefore sorted) by file name. Each entry's
+     * version is the server version the local copy was last synced with
+     */
+    std::map<std::string, dfs_service::FileStatus> localIndex;
+
+    /** Guards localIndex and remoteDeletes **/
+    mutable DFSMutex localIndexMutex{DFSLockClass::Named("local_index")};
+
+    /** Files deleted locally because they were deleted on the server, so the watcher doesn't delete them again **/
+    std::set<std::string> remoteDeletes;
+
+    /** When the user last stored, fetched or deleted each file, for putting them first in a sync. Guarded by localIndexMutex **/
+    std::map<std::string, std::chrono::steady_clock::time_point> touchedFiles;
+
+    /**
+     * Note that the user, through the watcher or a command, just worked on a file
+     *
+     * @param filename
+     */
+    void Touch(const std::string& filename);
+
+    /**
+     * Record the given `stat` result for a file in the local index
+     *
+     * @param filename
+     * @param st
+     */
+    void IndexLocalFile(const std::string& filename, const struct stat& st);
+
+    /**
+     * Refresh the local index entry for a file from disk, dropping it if the file is gone
+     *
+     * @param filename
+     */
+    void ReindexLocalFile(const std::string& filename);
+
+    /**
+     * Drop a file from the local index
+     *
+     * @param filename
+     */
+    void UnindexLocalFile(const std::string& filename);
+
+    /**
+     * The server version the local copy of a file was last synced with
+     *
+     * @param filename
+     * @param version set to the version, 0 if the file isn't indexed or has never been synced,
+     *        i.e. it must not exist on the server
+     * @return false if the client keeps no index of the mount, as for a one-off command, so the
+     *         version isn't known at all
+     */
+    bool IndexedVersion(const std::string& filename, google::protobuf::uint64* version);
+
+    /**
+     * Record the server version the local copy of an indexed file now matches
+     *
+     * @param filename
+     * @param version
+     * @param checksum of the local copy, 0 if not known
+     */
+    void SetIndexedVersion(const std::string& filename, google::protobuf::uint64 version, std::uint32_t checksum);
+
+    /** Bumped on every change to localIndex, so SaveSyncState can tell when there is nothing new. Guarded by localIndexMutex **/
+    google::protobuf::uint64 indexChanges;
+
+    /** Set by SeedLocalIndex, since only a mounted client keeps a sync state and knows its files' versions **/
+    std::atomic<bool> syncStateEnabled;
+
+    /** Guards the saved markers and the state file itself **/
+    DFSMutex syncStateMutex{DFSLockClass::Named("sync_state")};
+
+    /** The index changes and sequence the state file was last written at **/
+    google::protobuf::uint64 savedIndexChanges;
+    google::protobuf::uint64 savedSequence;
+
+    /** Files SeedLocalIndex found changed or created, and deleted, while the client was away **/
+    std::vector<std::string> offlineStores;
+    std::vector<std::string> offlineDeletes;
+
+    /**
+     * Read the mount's saved sync state
+     *
+     * @param state
+     * @return false if there is none or it can't be read
+     */
+    bool LoadSyncState(dfs_service::SyncState* state);
+
+    /** The transfer pool, created on first use **/
+    DFSTransferPool& Pool();
+
+    /**
+     * The file version in a server response's metadata, 0 if there isn't one
+     *
+     * @param metadata
+     * @return the version
+     */
+    static google::protobuf::uint64 ServerVersion(const std::multimap<grpc::string_ref, grpc::string_ref>& metadata);
 
 };
 #endif
@@ -1,5 +1,8 @@
 #include <map>
+#include <deque>
+#include <atomic>
 #include <mutex>
+#include <condition_variable>
 #include <shared_mutex>
 #include <chrono>
 #include <cstdio>
@@ -10,6 +13,7 @@
 #include <fstream>
 #include <getopt.h>
 #include <dirent.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 #include <grpcpp/grpcpp.h>
 #include <utime.h>
@@ -17,9 +21,12 @@
 #include "proto-src/dfs-service.grpc.pb.h"
 #include "src/dfslibx-call-data.h"
 #include "src/dfslibx-service-runner.h"
+#include "src/dfslibx-sharded-table.h"
+#include "src/dfslibx-lock-stats.h"
 #include "dfslib-shared-p2.h"
 #include "dfslib-servernode-p2.h"
 #include <google/protobuf/util/time_util.h>
+#include <google/protobuf/arena.h>
 
 using grpc::Status;
 using grpc::Server;
@@ -35,6 +42,8 @@ using namespace dfs_service;
 using google::protobuf::util::TimeUtil;
 using google::protobuf::Timestamp;
 using google::protobuf::uint64;
+using google::protobuf::Arena;
+using google::protobuf::ArenaOptions;
 
 using namespace std;
 
@@ -45,9 +54,13 @@ using namespace std;
 // message types you are using in your `dfs-service.proto` file
 // to indicate a file request and a listing of files from the server
 //
-using FileRequestType = dfs_service::File;
+using FileRequestType = dfs_service::CallbackRequest;
 using FileListResponseType = dfs_service::Files;
 
+// CallbackList is served raw so one serialized listing can be shared by every waiting call
+using RawCallbackType = grpc::ByteBuffer;
+using CallbackData = DFSCallData<RawCallbackType, RawCallbackType>;
+
 using FileName = string;
 using ClientId = string;
 
@@ -78,22 +91,133 @@ extern dfs_log_level_e DFS_LOG_LEVEL;
 //      - Hint: as the crc checksum is a simple integer, you can pass it around inside your message types.
 //
 class DFSServiceImpl final :
-    public DFSService::WithAsyncMethod_CallbackList<DFSService::Service>,
-        public DFSCallDataManager<FileRequestType , FileListResponseType> {
+    public DFSService::WithRawMethod_CallbackList<DFSService::Service>,
+        public DFSCallDataManager<RawCallbackType, RawCallbackType> {
 
 private:
 
     /** The runner service used to start the service and manage asynchronicity **/
-    DFSServiceRunner<FileRequestType, FileListResponseType> runner;
+    DFSServiceRunner<RawCallbackType, RawCallbackType> runner;
 
     /** The mount path for the server **/
     std::string mount_path;
 
     /** Mutex for managing the queue requests **/
-    std::mutex queue_mutex;
+    DFSMutex queue_mutex{DFSLockClass::Named("queue")};
+
+    /** Signalled whenever the queue thread has work to do. Always used with queue_mutex **/
+    std::condition_variable_any queue_cv;
 
     /** The vector of queued tags used to manage asynchronous requests **/
-    std::vector<QueueRequest<FileRequestType, FileListResponseType>> queued_tags;
+    std::vector<QueueRequest<RawCallbackType, RawCallbackType>> queued_tags;
+
+    /** A CallbackList call held until the change sequence moves past what its client has seen **/
+    struct ParkedCallback {
+        CallbackData* call;
+        uint64 sequence;
+        std::chrono::steady_clock::time_point deadline;
+        /** The client's filter, or null if it wants every change **/
+        std::shared_ptr<const FileNameMatcher> filter;
+        std::string filter_key;
+        /** Set once a change the client wants has been committed **/
+        bool relevant;
+    };
+
+    /** CallbackList calls waiting on a change. Guarded by queue_mutex **/
+    std::vector<ParkedCallback> parked_callbacks;
+
+    /**
+     * Bumped on every change to the mount. Starts at the startup time in microseconds so
+     * that it keeps moving forward across restarts. Guarded by queue_mutex
+     */
+    uint64 change_sequence;
+
+    /** The longest a CallbackList call is held before it is answered regardless **/
+    std::chrono::milliseconds callback_hold_timeout;
+
+    /** A listing serialized once and shared, by reference count, by every call it answers **/
+    struct ListingSnapshot {
+        uint64 sequence;
+        grpc::ByteBuffer buffer;
+    };
+
+    /** Guards listing_snapshot and serializes rebuilding it **/
+    DFSMutex snapshot_mutex{DFSLockClass::Named("snapshot")};
+
+    /** The most recent listing snapshot for each filter in use, keyed by FileNameMatcher::Key **/
+    map<string, std::shared_ptr<const ListingSnapshot>> listing_snapshots;
+
+    /** Guards filter_cache **/
+    DFSMutex filter_mutex{DFSLockClass::Named("filter")};
+
+    /** Compiled client filters, keyed by FileNameMatcher::Key, so clients sharing a filter share its matcher **/
+    map<string, std::shared_ptr<const FileNameMatcher>> filter_cache;
+
+    /** The most recent change events, oldest first, for Subscribe streams to resume from. Guarded by queue_mutex **/
+    std::deque<ChangeEvent> change_log;
+
+    /** The sequence just before the oldest event still in change_log. Guarded by queue_mutex **/
+    uint64 change_log_start;
+
+    /** Signalled whenever an event is appended to change_log. Always used with queue_mutex **/
+    std::condition_variable_any subscriber_cv;
+
+    /** Open Subscribe streams. Guarded by queue_mutex **/
+    int subscriber_count;
+
+    /**
+     * Clients whose Subscribe stream just sent them a RESYNC, so the full listing that answers
+     * it was admitted with the stream rather than charged again. Guarded by queue_mutex
+     */
+    std::unordered_set<string> resync_grants;
+
+    /** A deleted file, remembered until every client has seen the delete **/
+    struct Tombstone {
+        uint64 sequence;
+        std::int64_t deleted_at;
+    };
+
+    /** Tombstones by file name. Guarded by queue_mutex **/
+    map<string, Tombstone> tombstones;
+
+    /** How far a client has acknowledged the change sequence, and when it was last heard from **/
+    struct ClientAck {
+        uint64 sequence;
+        std::chrono::steady_clock::time_point seen;
+    };
+
+    /** Clients that may still need tombstones, by client id. Guarded by queue_mutex **/
+    map<string, ClientAck> client_acks;
+
+    /** When the queue thread next compacts tombstones. Guarded by queue_mutex **/
+    std::chrono::steady_clock::time_point next_compaction;
+
+    /** A change held back until its file settles **/
+    struct PendingChange {
+        ChangeEvent::Type type;
+        std::uint32_t checksum;
+        std::chrono::steady_clock::time_point first_seen;
+        std::chrono::steady_clock::time_point settles_at;
+    };
+
+    /** Changes waiting for their file to settle, by file name. Guarded by queue_mutex **/
+    map<string, PendingChange> pending_changes;
+
+    /** How long a file must go unchanged before its change is published. Zero publishes at once **/
+    std::chrono::milliseconds coalesce_window;
+
+    /** Limits how many clients can start over from a full listing at once, e.g. after a restart **/
+    TokenBucket resync_admission;
+
+    /** Changes folded into one already pending, and the client fetches that saved. Guarded by queue_mutex **/
+    uint64 notifications_suppressed;
+    uint64 fetches_suppressed;
+
+    /** How often the queue thread logs the stats. Zero turns it off **/
+    std::chrono::milliseconds stats_interval;
+
+    /** When the queue thread next logs the stats. Guarded by queue_mutex **/
+    std::chrono::steady_clock::time_point next_stats_dump;
 
 
     /**
@@ -109,38 +233,501 @@ private:
     /** CRC Table kept in memory for faster calculations **/
     CRC::Table<std::uint32_t, 32> crc_table;
 
-    // Stores which client id has a write lock on which file name
-    shared_timed_mutex fileNameToClientIdRW;
-    map<FileName, ClientId> fileNameToClientId;
+    /** A write lock held by a client until it is released or its lease runs out **/
+    struct WriteLease {
+        ClientId client_id;
+        /** Bumped on every grant and renewal, so stale timer wheel entries can be told apart **/
+        uint64 generation;
+        std::chrono::steady_clock::time_point expires;
+    };
+
+    /** Everything the server tracks about a single file name **/
+    struct FileState {
+        // Syncronizes reading/writing to/fro the file
+        DFSSharedMutex access;
+        // Guards lease
+        DFSMutex lease_mutex;
+        // The client holding a write lease, if client_id isn't empty
+        WriteLease lease;
+
+        // Both locks are labelled with the file name, so the stats can tell which files are hot
+        explicit FileState(const FileName& name) :
+            access(AccessLocks(), name), lease_mutex(LeaseLocks(), name) {}
+
+        static DFSLockClass& AccessLocks() {
+            static DFSLockClass& lock_class = DFSLockClass::Named("file");
+            return lock_class;
+        }
+
+        static DFSLockClass& LeaseLocks() {
+            static DFSLockClass& lock_class = DFSLockClass::Named("lease");
+            return lock_class;
+        }
+
+        // Once nothing references it, the state only needs keeping while it holds a live lease
+        bool Idle() {
+            std::lock_guard<DFSMutex> lock(lease_mutex);
+            return lease.client_id.empty() || lease.expires <= std::chrono::steady_clock::now();
+        }
+    };
+
+    using FileTable = DFSShardedTable<FileState, DFS_FILE_TABLE_SHARDS>;
+
+    // Per-file state, sharded by file name so that operations on different files don't serialize.
+    // An entry lives while a request holds a handle to it or a lease is live, then is reclaimed
+    FileTable files;
+
+    /** The generation of the most recent lease granted **/
+    std::atomic<uint64> lease_generation;
+
+    /** How long a lease lasts unless renewed **/
+    std::chrono::milliseconds write_lease;
+
+    /** A lease due to expire, filed in the timer wheel slot for its expiry tick **/
+    struct LeaseTimer {
+        FileName file_name;
+        uint64 generation;
+        std::chrono::steady_clock::time_point expires;
+    };
+
+    /**
+     * Hashed timer wheel of lease expiries. Each slot covers one tick, and a lease longer than
+     * a full turn waits in its slot for later turns. Guarded by lease_wheel_mutex
+     */
+    std::vector<std::vector<LeaseTimer>> lease_wheel;
 
-    // Stores the mutex that actually syncronizes reading/writing to/fro the given file
-    shared_timed_mutex fileNameToRWMutexRW;
-    map<FileName, unique_ptr<shared_timed_mutex>> fileNameToRWMutex;
+    /** The last tick whose slot has been expired. Guarded by lease_wheel_mutex **/
+    std::int64_t lease_wheel_tick;
+
+    DFSMutex lease_wheel_mutex{DFSLockClass::Named("lease_wheel")};
+
+    /** Wakes the lease thread early when the service shuts down. Used with lease_wheel_mutex **/
+    std::condition_variable_any lease_wheel_cv;
+    bool stopping;
+
+    /** Turns the lease wheel **/
+    std::thread lease_thread;
 
     // Read/write synchronization to the entire mount directory. Created for ListFiles
-    shared_timed_mutex dirMutex;
+    DFSSharedMutex dirMutex{DFSLockClass::Named("dir")};
+
+    /** Uploads are written under here and renamed into the mount once complete **/
+    std::string staging_path;
+
+    /** Makes each upload's staging file name unique **/
+    std::atomic<uint64> staging_counter;
+
+    /**
+     * A fresh staging file name for a new version of a file. It lives inside the mount, so
+     * publishing it is an atomic rename on the same file system
+     *
+     * @param fileName
+     * @return the path
+     */
+    std::string StagingPath(const std::string& fileName) {
+        return staging_path + fileName + "." + std::to_string(staging_counter++);
+    }
+
+    /**
+     * Record a change to a file. The change is held until the file has gone a coalescing window
+     * without further changes, so a burst of writes reaches clients as a single event
+     *
+     * @param type
+     * @param fileName
+     * @param checksum the checksum of the file's new contents
+     */
+    void PublishChange(ChangeEvent::Type type, const string& fileName, std::uint32_t checksum) {
+        if (coalesce_window.count() == 0) {
+            CommitChange(type, fileName, checksum);
+            return;
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        {
+            std::lock_guard<DFSMutex> lock(queue_mutex);
+            auto pending = pending_changes.find(fileName);
+            if (pending == pending_changes.end()) {
+                pending_changes.emplace(fileName, PendingChange{type, checksum, now, now + coalesce_window});
+            } else {
+                // Every client that would have been woken for the folded change would also have fetched it
+                notifications_suppressed++;
+                fetches_suppressed += parked_callbacks.size() + subscriber_count;
+
+                pending->second.type = MergeChange(pending->second.type, type);
+                pending->second.checksum = checksum;
+                // Each change pushes the settle time back, but a file that never goes quiet
+                // is still published within a bounded delay of its first change
+                pending->second.settles_at = std::min(now + coalesce_window,
+                    pending->second.first_seen + coalesce_window * DFS_COALESCE_MAX_WINDOWS);
+            }
+        }
+        queue_cv.notify_one();
+    }
+
+    /**
+     * The single change equivalent to an earlier pending change followed by a later one. A file
+     * created and deleted within the window still goes out as DELETED, since a client may have
+     * listed or fetched it in between and has to drop its copy
+     */
+    static ChangeEvent::Type MergeChange(ChangeEvent::Type earlier, ChangeEvent::Type later) {
+        if (earlier == ChangeEvent::CREATED && later == ChangeEvent::MODIFIED) {
+            return ChangeEvent::CREATED;
+        }
+        if (earlier == ChangeEvent::DELETED && later == ChangeEvent::CREATED) {
+            return ChangeEvent::MODIFIED;
+        }
+        return later;
+    }
+
+    /**
+     * Append a change to the change log, wake the queue thread so parked callbacks are answered
+     * and push the event to Subscribe streams
+     *
+     * @param type
+     * @param fileName
+     * @param checksum the checksum of the file's new contents
+     */
+    void CommitChange(ChangeEvent::Type type, const string& fileName, std::uint32_t checksum) {
+        ChangeEvent event;
+        event.set_type(type);
+        event.set_name(fileName);
+        event.set_checksum(checksum);
+        struct stat st;
+        if (type == ChangeEvent::DELETED) {
+            event.mutable_modified()->set_seconds(time(nullptr));
+        } else if (stat(WrapPath(fileName).c_str(), &st) == 0) {
+            event.set_size(st.st_size);
+            event.mutable_modified()->set_seconds(st.st_mtime);
+            event.set_version(CurrentVersion(&st));
+        }
+        {
+            std::lock_guard<DFSMutex> lock(queue_mutex);
+            change_sequence++;
+            event.set_sequence(change_sequence);
+            if (type == ChangeEvent::DELETED) {
+                tombstones[fileName] = {change_sequence, event.modified().seconds()};
+            } else {
+                tombstones.erase(fileName);
+            }
+            for (ParkedCallback& parked : parked_callbacks) {
+                if (!parked.relevant && (!parked.filter || parked.filter->Matches(fileName))) {
+                    parked.relevant = true;
+                }
+            }
+            change_log.push_back(std::move(event));
+            if (change_log.size() > DFS_CHANGE_LOG_SIZE) {
+                change_log.pop_front();
+                change_log_start++;
+            }
+        }
+        queue_cv.notify_one();
+        subscriber_cv.notify_all();
+    }
+
+    /**
+     * Get the compiled matcher for a client's filter, compiling it on first use
+     *
+     * @param filter
+     * @param key set to the filter's canonical key
+     * @return the matcher, or null if the filter passes everything
+     */
+    std::shared_ptr<const FileNameMatcher> CompileFilter(const SubscriptionFilter& filter, string* key) {
+        *key = FileNameMatcher::Key(filter);
+        if (key->empty()) {
+            return nullptr;
+        }
+
+        std::lock_guard<DFSMutex> lock(filter_mutex);
+        auto cached = filter_cache.find(*key);
+        if (cached != filter_cache.end()) {
+            return cached->second;
+        }
+        if (filter_cache.size() >= DFS_FILTER_CACHE_SIZE) {
+            // Forget the filters no call is using any more
+            for (auto it = filter_cache.begin(); it != filter_cache.end(); ) {
+                it = it->second.use_count() == 1 ? filter_cache.erase(it) : std::next(it);
+            }
+        }
+        auto matcher = std::make_shared<const FileNameMatcher>(filter);
+        filter_cache.emplace(*key, matcher);
+        dfs_log(LL_DEBUG) << "Compiled filter " << filter.ShortDebugString();
+        return matcher;
+    }
+
+    /**
+     * Note how far a client has caught up. Must be called with queue_mutex held
+     *
+     * @param clientId
+     * @param sequence the last change the client has seen
+     */
+    void RecordAck(const string& clientId, uint64 sequence) {
+        if (clientId.empty()) {
+            return;
+        }
+        ClientAck& ack = client_acks[clientId];
+        // A sequence from an earlier run of the server says nothing about this one
+        ack.sequence = sequence > change_sequence ? 0 : sequence;
+        ack.seen = std::chrono::steady_clock::now();
+    }
+
+    /**
+     * Drop the tombstones every client has acknowledged, forgetting clients that haven't been
+     * heard from in a long time. Must be called with queue_mutex held
+     */
+    void CompactTombstones() {
+        auto now = std::chrono::steady_clock::now();
+        uint64 acked = change_sequence;
+        for (auto it = client_acks.begin(); it != client_acks.end(); ) {
+            if (now - it->second.seen > std::chrono::milliseconds(DFS_CLIENT_ACK_TIMEOUT)) {
+                dfs_log(LL_SYSINFO) << "Forgetting client " << it->first << " last seen at sequence " << it->second.sequence;
+                it = client_acks.erase(it);
+                continue;
+            }
+            acked = std::min(acked, it->second.sequence);
+            it++;
+        }
+        size_t before = tombstones.size();
+        for (auto it = tombstones.begin(); it != tombstones.end(); ) {
+            it = it->second.sequence <= acked ? tombstones.erase(it) : std::next(it);
+        }
+        if (tombstones.size() != before) {
+            dfs_log(LL_DEBUG) << "Compacted " << (before - tombstones.size()) << " tombstones acknowledged through sequence "
+                << acked << ". " << tombstones.size() << " left";
+        }
+    }
+
+    /**
+     * Add the tombstones that pass the filter to a listing
+     *
+     * @param filter null for every tombstone
+     * @param response
+     */
+    void AddTombstones(const FileNameMatcher* filter, Files* response) {
+        std::lock_guard<DFSMutex> lock(queue_mutex);
+        for (const auto& tombstone : tombstones) {
+            if (filter && !filter->Matches(tombstone.first)) {
+                continue;
+            }
+            FileStatus* deleted = response->add_deleted();
+            deleted->set_name(tombstone.first);
+            deleted->mutable_modified()->set_seconds(tombstone.second.deleted_at);
+        }
+    }
+
+    /**
+     * Whether a client at the given sequence can only catch up from a full listing, because it
+     * is new, was behind the change log or last synced against an earlier run of the server.
+     * Must be called with queue_mutex held
+     */
+    bool NeedsResync(uint64 sequence) {
+        return sequence < change_log_start || sequence > change_sequence;
+    }
+
+    /**
+     * Whether a change that passes the filter was committed after the given sequence. Must be
+     * called with queue_mutex held
+     *
+     * @param sequence
+     * @param filter
+     * @return bool, true if the change log no longer reaches back that far
+     */
+    bool ChangedSince(uint64 sequence, const FileNameMatcher& filter) {
+        if (sequence < change_log_start) {
+            return true;
+        }
+        for (auto it = change_log.begin() + (sequence - change_log_start); it != change_log.end(); it++) {
+            if (filter.Matches(it->name())) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // The checksum the client sent for its copy of the file, or 0 if it didn't send one
+    std::uint32_t ClientChecksum(const multimap<string_ref, string_ref>& metadata) {
+        auto clientCheckSumV = metadata.find(CheckSumMetadataKey);
+        if (clientCheckSumV == metadata.end()){
+            return 0;
+        }
+        return stoul(string(clientCheckSumV->second.begin(), clientCheckSumV->second.end()));
+    }
+
+    // Release a client's write lock. A lease that lapsed and went to another client is left alone
+    void ReleaseClientLock(FileState* state, const ClientId& clientId) {
+        state->lease_mutex.lock();
+        if (state->lease.client_id == clientId) {
+            state->lease.client_id.clear();
+        }
+        state->lease_mutex.unlock();
+    }
+
+    // Take a client's write lease on a file, or extend it if the client already holds it
+    Status AcquireLease(const string& fileName, FileState* state, const ClientId& clientId, WriteLock* response) {
+        state->lease_mutex.lock();
+        const WriteLease* lease = LiveLease(state);
+        string lockClientId;
+        // Lock already exists that isn't held by this client. Fail
+        if (lease != nullptr && (lockClientId = lease->client_id).compare(clientId) != 0){
+            state->lease_mutex.unlock();
+
+            stringstream ss;
+            ss << "Acquiring lock failed. File " << fileName << " already has a write lock from client " << lockClientId << " Your id: " << clientId;
+            dfs_log(LL_ERROR) << ss.str();
+            return Status(StatusCode::RESOURCE_EXHAUSTED, ss.str());
+        // This client already has a lock on this file. Extend it and return OK
+        } else if (lease != nullptr) {
+            GrantLease(fileName, state, clientId, response);
+            state->lease_mutex.unlock();
+
+            dfs_log(LL_SYSINFO) << "Your client id " << clientId << " already has a lock on " << fileName;
+            return Status::OK;
+        }
+        GrantLease(fileName, state, clientId, response);
+        state->lease_mutex.unlock();
+
+        return Status::OK;
+    }
+
+    /**
+     * Check that a client may write or delete a file as far as leases go. An unconditional write
+     * needs the client's own lease. A conditional one needs no lease, but is still kept out of a
+     * file another client holds one on, e.g. under an AcquireWriteLocks batch
+     *
+     * @param fileName
+     * @param state
+     * @param clientId
+     * @param conditional
+     * @return Status OK, RESOURCE_EXHAUSTED for a conditional write to a file locked by another
+     *         client, INTERNAL for an unconditional one without the client's own lease
+     */
+    Status CheckLease(const string& fileName, FileState* state, const ClientId& clientId, bool conditional) {
+        state->lease_mutex.lock();
+        const WriteLease* lease = LiveLease(state);
+        string lockClientId = lease == nullptr ? "" : lease->client_id;
+        state->lease_mutex.unlock();
+
+        stringstream ss;
+        if (lease != nullptr && lockClientId.compare(clientId) != 0) {
+            ss << "File " << fileName << " already has a lock from client " << lockClientId << ". Your id: " << clientId;
+            dfs_log(LL_ERROR) << ss.str();
+            return Status(conditional ? StatusCode::RESOURCE_EXHAUSTED : StatusCode::INTERNAL, ss.str());
+        } else if (lease == nullptr && !conditional) {
+            ss << "Your client id " << clientId << " doesn't have a write lock for file " << fileName;
+            dfs_log(LL_ERROR) << ss.str();
+            return Status(StatusCode::INTERNAL, ss.str());
+        }
+        return Status::OK;
+    }
+
+    /**
+     * The version of a file, its change time in microseconds. Every publish renames a new copy
+     * into place, which moves the change time on, so it tells versions apart as a counter would.
+     * Unlike a counter it needs no state and survives a restart, so clients still recognise the
+     * versions they synced, and a file changed in the mount while the server was down gets a
+     * new one
+     *
+     * @param st the file's stat, or null if it doesn't exist
+     * @return the version, 0 if the file doesn't exist
+     */
+    static uint64 CurrentVersion(const struct stat* st) {
+        if (st == nullptr) {
+            return 0;
+        }
+        return std::max<uint64>(static_cast<uint64>(st->st_ctim.tv_sec) * 1000000 + st->st_ctim.tv_nsec / 1000, 1);
+    }
+
+    /**
+     * Fail a conditional write or delete whose expected version is no longer current. The current
+     * version goes back in the trailing metadata so the client can tell what it lost to
+     *
+     * @param context
+     * @param fileName
+     * @param expected
+     * @param current
+     * @return Status FAILED_PRECONDITION
+     */
+    Status VersionConflict(ServerContext* context, const string& fileName, uint64 expected, uint64 current) {
+        context->AddTrailingMetadata(VersionMetadataKey, to_string(current));
+        stringstream ss;
+        ss << "File " << fileName << " is at version " << current << ", not the expected " << expected;
+        dfs_log(LL_ERROR) << ss.str();
+        return Status(StatusCode::FAILED_PRECONDITION, ss.str());
+    }
 
-    void ReleaseClientLock(string fileName) {
-        fileNameToClientIdRW.lock();
-        fileNameToClientId.erase(fileName);
-        fileNameToClientIdRW.unlock();
+    // The unexpired lease on a file, or null. Must be called with the file's lease_mutex held
+    const WriteLease* LiveLease(const FileState* state) {
+        // The wheel may not have reached an expired lease yet
+        if (state->lease.client_id.empty() || state->lease.expires <= std::chrono::steady_clock::now()) {
+            return nullptr;
+        }
+        return &state->lease;
     }
 
-    shared_timed_mutex* UnsafeGetFileRWMutex(string fileName) {
-        fileNameToRWMutexRW.lock_shared();
-        auto fileAccessMutexV = fileNameToRWMutex.find(fileName);
-        // TODO: Skipping check whether it exists since I assume AddFileRWMutex is always called prior
-        shared_timed_mutex* fileAccessMutex = fileAccessMutexV->second.get();
-        fileNameToRWMutexRW.unlock_shared();
-        return fileAccessMutex;
+    // Grant or extend a client's lease. Must be called with the file's lease_mutex held
+    void GrantLease(const string& fileName, FileState* state, const ClientId& clientId, WriteLock* response) {
+        WriteLease& lease = state->lease;
+        lease.client_id = clientId;
+        lease.generation = ++lease_generation;
+        lease.expires = std::chrono::steady_clock::now() + write_lease;
+        response->set_lease_ms(write_lease.count());
+
+        std::lock_guard<DFSMutex> lock(lease_wheel_mutex);
+        // File the lease under the tick after it expires, so its slot never comes round early
+        std::int64_t tick = WheelTick(lease.expires) + 1;
+        lease_wheel[tick % DFS_LEASE_WHEEL_SLOTS].push_back({fileName, lease.generation, lease.expires});
     }
 
-    void AddFileRWMutex(string fileName) {
-        fileNameToRWMutexRW.lock();
-        if (fileNameToRWMutex.find(fileName) == fileNameToRWMutex.end()){
-            fileNameToRWMutex[fileName] = make_unique<shared_timed_mutex>();
+    static std::int64_t WheelTick(std::chrono::steady_clock::time_point time) {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(time.time_since_epoch()).count() / DFS_LEASE_WHEEL_TICK;
+    }
+
+    /**
+     * Turn the lease wheel once a tick, dropping the leases whose time is up
+     */
+    void ExpireLeases() {
+        while (true) {
+            vector<LeaseTimer> due;
+            {
+                std::unique_lock<DFSMutex> lock(lease_wheel_mutex);
+                auto next_tick = std::chrono::steady_clock::time_point(
+                    std::chrono::milliseconds((lease_wheel_tick + 1) * DFS_LEASE_WHEEL_TICK));
+                if (lease_wheel_cv.wait_until(lock, next_tick, [this]{ return stopping; })) {
+                    return;
+                }
+
+                auto now = std::chrono::steady_clock::now();
+                std::int64_t now_tick = WheelTick(now);
+                // Catch up on any ticks missed, but never go round more than once
+                std::int64_t from = std::max(lease_wheel_tick + 1, now_tick - DFS_LEASE_WHEEL_SLOTS + 1);
+                for (std::int64_t tick = from; tick <= now_tick; tick++) {
+                    vector<LeaseTimer>& slot = lease_wheel[tick % DFS_LEASE_WHEEL_SLOTS];
+                    auto later = std::partition(slot.begin(), slot.end(),
+                        [now](const LeaseTimer& timer) { return timer.expires > now; });
+                    std::move(later, slot.end(), std::back_inserter(due));
+                    slot.erase(later, slot.end());
+                }
+                lease_wheel_tick = now_tick;
+            }
+
+            if (due.empty()) {
+                continue;
+            }
+            for (const LeaseTimer& timer : due) {
+                FileTable::Handle state = files.Find(timer.file_name);
+                if (!state) {
+                    continue;
+                }
+                state->lease_mutex.lock();
+                // Leases renewed or released since this timer was filed are left alone
+                if (!state->lease.client_id.empty() && state->lease.generation == timer.generation) {
+                    dfs_log(LL_SYSINFO) << "Write lease on " << timer.file_name << " held by client "
+                        << state->lease.client_id << " expired";
+                    state->lease.client_id.clear();
+                }
+                state->lease_mutex.unlock();
+                // Dropping the handle reclaims the state if nothing else is using it
+            }
         }
-        fileNameToRWMutexRW.unlock();
     }
 
     // client and server checksum should not match
@@ -162,42 +749,102 @@ private:
         return Status::OK;
     }
 
+    /**
+     * The lock stats of the whole process, plus the server's own counters
+     *
+     * @param stats
+     */
+    void CollectStats(Stats* stats) {
+        fillLockStats(stats);
+        auto add = [stats](const string& name, uint64 value) {
+            Counter* counter = stats->add_counter();
+            counter->set_name(name);
+            counter->set_value(value);
+        };
+        {
+            std::lock_guard<DFSMutex> lock(queue_mutex);
+            add("notifications_suppressed", notifications_suppressed);
+            add("fetches_suppressed", fetches_suppressed);
+            add("pending_changes", pending_changes.size());
+            add("parked_callbacks", parked_callbacks.size());
+            add("subscribers", subscriber_count);
+            add("tombstones", tombstones.size());
+        }
+        add("callback_calls_served", CallbackData::CallPool().Acquired());
+        add("callback_calls_from_heap", CallbackData::CallPool().HeapAllocations());
+        add("callback_calls_in_flight", CallbackData::CallPool().InUse());
+        add("files_with_state", files.Size());
+    }
+
 public:
 
-    DFSServiceImpl(const std::string& mount_path, const std::string& server_address, int num_async_threads):
-        mount_path(mount_path), crc_table(CRC::CRC_32()) {
+    DFSServiceImpl(const std::string& mount_path, const std::string& server_address, int num_async_threads,
+                   int callback_hold_timeout, int coalesce_window, double resync_rate, int resync_burst,
+                   int write_lease, int stats_interval):
+        mount_path(mount_path),
+        change_sequence(std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count()),
+        callback_hold_timeout(callback_hold_timeout),
+        change_log_start(change_sequence),
+        subscriber_count(0),
+        next_compaction(std::chrono::steady_clock::now()),
+        coalesce_window(coalesce_window),
+        resync_admission(resync_rate, resync_burst),
+        notifications_suppressed(0),
+        fetches_suppressed(0),
+        stats_interval(stats_interval),
+        next_stats_dump(std::chrono::steady_clock::now() + this->stats_interval),
+        crc_table(CRC::CRC_32()),
+        files(DFSLockClass::Named("file_table")),
+        lease_generation(0),
+        write_lease(write_lease),
+        lease_wheel(DFS_LEASE_WHEEL_SLOTS),
+        lease_wheel_tick(WheelTick(std::chrono::steady_clock::now())),
+        stopping(false),
+        staging_path(mount_path + ".dfs-staging/"),
+        staging_counter(0) {
 
         this->runner.SetService(this);
         this->runner.SetAddress(server_address);
         this->runner.SetNumThreads(num_async_threads);
         this->runner.SetQueuedRequestsCallback([&]{ this->ProcessQueuedRequests(); });
+        lease_thread = std::thread(&DFSServiceImpl::ExpireLeases, this);
 
-        // populate existing files in inProgressFileNameToMutex
         DIR *dir;
         if ((dir = opendir(mount_path.c_str())) == NULL) {
             // could not open directory 
             dfs_log(LL_ERROR) << "Failed to open directory at mount path " << mount_path;
             exit(EXIT_FAILURE);
         }
-        // traverse everything in directory 
-        struct dirent *ent;
-        while ((ent = readdir(dir)) != NULL) {
-            struct stat path_stat;
-            string dirEntry(ent->d_name);
-            string path = WrapPath(dirEntry);
-            stat(path.c_str(), &path_stat);
-            // if dir item is a file
-            if (!S_ISREG(path_stat.st_mode)){
-                dfs_log(LL_SYSINFO) << "Found dir at " << path << " - Skipping";
-                continue;
+        closedir(dir);
+
+        // Uploads left half written by a previous run were never published, so can go
+        if (mkdir(staging_path.c_str(), 0755) != 0 && errno != EEXIST) {
+            dfs_log(LL_ERROR) << "Failed to create staging directory " << staging_path << ": " << strerror(errno);
+            exit(EXIT_FAILURE);
+        }
+        if ((dir = opendir(staging_path.c_str())) != NULL) {
+            struct dirent *ent;
+            while ((ent = readdir(dir)) != NULL) {
+                string path = staging_path + ent->d_name;
+                struct stat path_stat;
+                if (stat(path.c_str(), &path_stat) == 0 && S_ISREG(path_stat.st_mode)) {
+                    unlink(path.c_str());
+                }
             }
-            dfs_log(LL_SYSINFO) << "Found file at " << path;
-            fileNameToRWMutex[dirEntry] = make_unique<shared_timed_mutex>();
+            closedir(dir);
         }
-        closedir(dir);
     }
 
     ~DFSServiceImpl() {
+        {
+            std::lock_guard<DFSMutex> lock(lease_wheel_mutex);
+            stopping = true;
+        }
+        lease_wheel_cv.notify_one();
+        if (lease_thread.joinable()) {
+            lease_thread.join();
+        }
         this->runner.Shutdown();
     }
 
@@ -220,13 +867,16 @@ public:
      * @param tag
      */
     void RequestCallback(grpc::ServerContext* context,
-                         FileRequestType* request,
-                         grpc::ServerAsyncResponseWriter<FileListResponseType>* response,
+                         RawCallbackType* request,
+                         grpc::ServerAsyncResponseWriter<RawCallbackType>* response,
                          grpc::ServerCompletionQueue* cq,
                          void* tag) {
 
-        std::lock_guard<std::mutex> lock(queue_mutex);
-        this->queued_tags.emplace_back(context, request, response, cq, tag);
+        {
+            std::lock_guard<DFSMutex> lock(queue_mutex);
+            this->queued_tags.emplace_back(context, request, response, cq, tag);
+        }
+        queue_cv.notify_one();
 
     }
 
@@ -243,7 +893,8 @@ public:
      * @param request
      * @param response
      */
-    void ProcessCallback(ServerContext* context, FileRequestType* request, FileListResponseType* response) {
+    bool ProcessCallback(ServerContext* context, RawCallbackType* request, RawCallbackType* response,
+                         CallbackData* call) {
 
         //
         // STUDENT INSTRUCTION:
@@ -254,15 +905,178 @@ public:
         // The client should receive a list of files or modifications that represent the changes this service
         // is aware of. The client will then need to make the appropriate calls based on those changes.
         //
-        dfs_log(LL_DEBUG2) << "Handling ProcessCallback call. Filename: " << request->name();
-        Status status = this->CallbackList(context, request, response);
+        FileRequestType callbackRequest;
+        if (!grpc::SerializationTraits<FileRequestType>::Deserialize(request, &callbackRequest).ok()) {
+            // An empty request would read as sequence 0 and cost the server a full resync
+            dfs_log(LL_ERROR) << "Failed to parse CallbackList request";
+            call->Fail(Status(StatusCode::INVALID_ARGUMENT, "Malformed CallbackList request"));
+            return false;
+        }
+        dfs_log(LL_DEBUG2) << "Handling ProcessCallback call. Client sequence: " << callbackRequest.sequence();
+
+        string filterKey;
+        std::shared_ptr<const FileNameMatcher> filter = CompileFilter(callbackRequest.filter(), &filterKey);
+
+        // Nothing the client cares about has changed since its last listing. Park the call until something does
+        bool parked = false;
+        {
+            std::lock_guard<DFSMutex> lock(queue_mutex);
+            uint64 sequence = callbackRequest.sequence();
+            RecordAck(callbackRequest.client_id(), sequence);
+            bool resync = NeedsResync(sequence);
+            if (resync && resync_grants.erase(callbackRequest.client_id()) == 0 && !resync_admission.TryTake()) {
+                dfs_log(LL_SYSINFO) << "Turning away full resync from sequence " << sequence;
+                call->Fail(Status(StatusCode::RESOURCE_EXHAUSTED, "Too many clients resyncing. Back off and retry"));
+                return false;
+            }
+            // A client ahead of the server synced against an earlier run of it. It was admitted as
+            // a resync above and gets its listing now, rather than waiting on this run to catch up
+            if (!resync && (sequence == change_sequence || (filter && !ChangedSince(sequence, *filter)))) {
+                parked_callbacks.push_back({call, sequence, std::chrono::steady_clock::now() + callback_hold_timeout,
+                    filter, filterKey, false});
+                dfs_log(LL_DEBUG2) << "Parked CallbackList at sequence " << sequence;
+                parked = true;
+            }
+        }
+        // A parked call's hold timeout may come before the queue thread was going to wake up
+        queue_cv.notify_one();
+        if (parked) {
+            return false;
+        }
+
+        *response = CurrentListing(context, filterKey, filter.get())->buffer;
+        return true;
+
+    }
+
+    /**
+     * Get a serialized listing that is current as of the latest change sequence,
+     * reusing the last one built for the same filter if nothing has changed since
+     *
+     * @param context
+     * @param filterKey
+     * @param filter null for an unfiltered listing
+     * @return the shared snapshot
+     */
+    std::shared_ptr<const ListingSnapshot> CurrentListing(ServerContext* context, const string& filterKey,
+                                                          const FileNameMatcher* filter) {
+        std::lock_guard<DFSMutex> snapshot_lock(snapshot_mutex);
+
+        uint64 sequence;
+        {
+            std::lock_guard<DFSMutex> lock(queue_mutex);
+            sequence = change_sequence;
+        }
+        auto cached = listing_snapshots.find(filterKey);
+        if (cached != listing_snapshots.end() && cached->second->sequence == sequence) {
+            return cached->second;
+        }
+
+        Arena& arena = ListingArena();
+        FileListResponseType* listing = Arena::CreateMessage<FileListResponseType>(&arena);
+        listing->set_sequence(sequence);
+        Status status = FilteredListing(context, filter, listing);
+        AddTombstones(filter, listing);
+        if (!status.ok()) {
+            dfs_log(LL_ERROR) << "CallbackList via ProcessCallback failed - message: " << status.error_message() << ", code: " << status_code_str(status.error_code());
+        }
+
+        auto snapshot = std::make_shared<ListingSnapshot>();
+        snapshot->sequence = sequence;
+        bool own_buffer;
+        grpc::SerializationTraits<FileListResponseType>::Serialize(*listing, &snapshot->buffer, &own_buffer);
+        dfs_log(LL_DEBUG2) << "Serialized listing of " << listing->file_size() << " files at sequence " << sequence
+            << " from " << arena.SpaceAllocated() << " arena bytes";
+        // The listing lives on in the serialized copy, so its messages can all go at once
+        arena.Reset();
+
+        // Snapshots from before this sequence will never be handed out again
+        for (auto it = listing_snapshots.begin(); it != listing_snapshots.end(); ) {
+            it = it->second->sequence < sequence ? listing_snapshots.erase(it) : std::next(it);
+        }
+        listing_snapshots[filterKey] = snapshot;
+        return snapshot;
+    }
+
+    /**
+     * The arena this thread builds listings on. Reset after each listing, keeping its initial block
+     */
+    static Arena& ListingArena() {
+        static thread_local std::unique_ptr<char[]> initial_block(new char[DFS_LISTING_ARENA_INITIAL_BLOCK]);
+        static thread_local Arena arena([]{
+            ArenaOptions options;
+            options.initial_block = initial_block.get();
+            options.initial_block_size = DFS_LISTING_ARENA_INITIAL_BLOCK;
+            options.start_block_size = DFS_LISTING_ARENA_INITIAL_BLOCK;
+            options.max_block_size = DFS_LISTING_ARENA_MAX_BLOCK;
+            return options;
+        }());
+        return arena;
+    }
+
+    /**
+     * List the mount, keeping only the files that pass the filter
+     *
+     * @param context
+     * @param filter null to keep every file
+     * @param response
+     * @return Status
+     */
+    Status FilteredListing(ServerContext* context, const FileNameMatcher* filter, Files* response) {
+        dirMutex.lock_shared();
+        DIR *dir;
+        if ((dir = opendir(mount_path.c_str())) == NULL) {
+            dirMutex.unlock_shared();
+
+            // could not open directory 
+            dfs_log(LL_ERROR) << "Failed to open directory at mount path " << mount_path;
+            return Status::OK;
+        }
+        // traverse everything in directory 
+        struct dirent *ent;
+        while ((ent = readdir(dir)) != NULL) {
+            // TODO: Leaving this out for simplicity since it throws an exception via async calls
+            /*if (context->IsCancelled()){
+                dirMutex.unlock_shared();
+
+                const string& err = "Request deadline has expired";
+                dfs_log(LL_ERROR) << err;
+                return Status(StatusCode::DEADLINE_EXCEEDED, err);
+            }*/
+            string dirEntry(ent->d_name);
+            // Filtered out entries cost neither a stat nor an allocation
+            if (filter && !filter->Matches(dirEntry)) {
+                continue;
+            }
+            struct stat path_stat;
+            string path = WrapPath(dirEntry);
+            if (stat(path.c_str(), &path_stat) != 0) {
+                closedir(dir);
+                dirMutex.unlock_shared();
+
+                stringstream ss;
+                ss << "Getting file info for file " << path << " failed with: " << strerror(errno) << endl;
+                dfs_log(LL_ERROR) << ss.str();
+                return Status(StatusCode::NOT_FOUND, ss.str());
+            }
+            // if dir item is a file
+            if (!S_ISREG(path_stat.st_mode)){
+                dfs_log(LL_DEBUG2) << "Found dir at " << path << " - Skipping";
+                continue;
+            }
+            dfs_log(LL_DEBUG2) << "Found file at " << path;
 
-        if (!status.ok()) {
-            dfs_log(LL_ERROR) << "CallbackList via ProcessCallback failed - message: " << status.error_message() << ", code: " << status_code_str(status.error_code());
-            return;
+            // The entry, its name and its timestamps are all allocated alongside the response,
+            // on the listing arena when there is one
+            FileStatus* ack = response->add_file();
+            ack->set_name(dirEntry);
+            fillFileStatus(path_stat, ack);
+            ack->set_version(CurrentVersion(&path_stat));
         }
-        dfs_log(LL_DEBUG2) << "ProcessCallback success - response: " << response->DebugString();
+        closedir(dir);
+        dirMutex.unlock_shared();
 
+        return Status::OK;
     }
 
     /**
@@ -281,14 +1095,43 @@ public:
             // may add any additional code you feel is necessary.
             //
 
+            std::vector<ParkedCallback> ready;
+            std::vector<std::pair<string, PendingChange>> settled;
+            bool dump_stats = false;
 
             // Guarded section for queue
             {
                 dfs_log(LL_DEBUG2) << "Waiting for queue guard";
-                std::lock_guard<std::mutex> lock(queue_mutex);
-
-
-                for(QueueRequest<FileRequestType, FileListResponseType>& queue_request : this->queued_tags) {
+                std::unique_lock<DFSMutex> lock(queue_mutex);
+
+                // Sleep until a callback is registered, a parked callback's client falls behind
+                // the change sequence, a pending change settles, or the earliest parked callback
+                // reaches its hold timeout
+                auto wake_at = std::chrono::steady_clock::time_point::max();
+                for (const ParkedCallback& parked : parked_callbacks) {
+                    wake_at = std::min(wake_at, parked.deadline);
+                }
+                for (const auto& pending : pending_changes) {
+                    wake_at = std::min(wake_at, pending.second.settles_at);
+                }
+                if (!tombstones.empty()) {
+                    wake_at = std::min(wake_at, next_compaction);
+                }
+                if (stats_interval.count() > 0) {
+                    wake_at = std::min(wake_at, next_stats_dump);
+                }
+                queue_cv.wait_until(lock, wake_at, [this, wake_at]{
+                    // A change that settles, or a call parked since, whose hold runs out before
+                    // wake_at means the sleep has to be shortened
+                    return !this->queued_tags.empty() || std::any_of(parked_callbacks.begin(), parked_callbacks.end(),
+                        [wake_at](const ParkedCallback& parked) { return parked.relevant || parked.deadline < wake_at; }) ||
+                        std::any_of(pending_changes.begin(), pending_changes.end(),
+                        [wake_at](const std::pair<const string, PendingChange>& pending) { return pending.second.settles_at < wake_at; });
+                });
+
+                for(QueueRequest<RawCallbackType, RawCallbackType>& queue_request : this->queued_tags) {
+                    dfs_log(LL_DEBUG2) << "Queue wake-up latency: " << std::chrono::duration_cast<std::chrono::microseconds>(
+                        std::chrono::steady_clock::now() - queue_request.queued_at).count() << "us";
                     this->RequestCallbackList(queue_request.context, queue_request.request,
                         queue_request.response, queue_request.cq, queue_request.cq, queue_request.tag);
                     queue_request.finished = true;
@@ -298,9 +1141,73 @@ public:
                 this->queued_tags.erase(std::remove_if(
                     this->queued_tags.begin(),
                     this->queued_tags.end(),
-                    [](QueueRequest<FileRequestType, FileListResponseType>& queue_request) { return queue_request.finished; }
+                    [](QueueRequest<RawCallbackType, RawCallbackType>& queue_request) { return queue_request.finished; }
                 ), this->queued_tags.end());
 
+                auto now = std::chrono::steady_clock::now();
+                if (now >= next_compaction) {
+                    CompactTombstones();
+                    next_compaction = now + std::chrono::milliseconds(DFS_TOMBSTONE_COMPACT_INTERVAL);
+                }
+                if (stats_interval.count() > 0 && now >= next_stats_dump) {
+                    dump_stats = true;
+                    next_stats_dump = now + stats_interval;
+                }
+                for (auto it = pending_changes.begin(); it != pending_changes.end(); ) {
+                    if (it->second.settles_at <= now) {
+                        settled.emplace_back(it->first, it->second);
+                        it = pending_changes.erase(it);
+                    } else {
+                        it++;
+                    }
+                }
+            }
+
+            // Publish settled changes outside the guard, since each one stats its file
+            for (const auto& change : settled) {
+                CommitChange(change.second.type, change.first, change.second.checksum);
+            }
+            if (!settled.empty()) {
+                std::lock_guard<DFSMutex> lock(queue_mutex);
+                dfs_log(LL_DEBUG) << "Published " << settled.size() << " settled changes. Suppressed so far: "
+                    << notifications_suppressed << " notifications, " << fetches_suppressed << " fetches";
+            }
+
+            if (dump_stats) {
+                Stats stats;
+                CollectStats(&stats);
+                dfs_log(LL_SYSINFO) << "Stats:\n" << formatStats(stats);
+            }
+
+            // Release parked callbacks that have something new to see or have been held long enough
+            {
+                std::lock_guard<DFSMutex> lock(queue_mutex);
+                auto now = std::chrono::steady_clock::now();
+                auto still_parked = std::partition(parked_callbacks.begin(), parked_callbacks.end(),
+                    [now](const ParkedCallback& parked) { return !parked.relevant && parked.deadline > now; });
+                std::move(still_parked, parked_callbacks.end(), std::back_inserter(ready));
+                parked_callbacks.erase(still_parked, parked_callbacks.end());
+            }
+
+            // Build the listings outside the queue guard so changes can keep being published,
+            // then fan each serialized copy out to every released call sharing its filter
+            std::sort(ready.begin(), ready.end(),
+                [](const ParkedCallback& a, const ParkedCallback& b) { return a.filter_key < b.filter_key; });
+            for (auto group = ready.begin(); group != ready.end(); ) {
+                std::shared_ptr<const ListingSnapshot> snapshot = CurrentListing(group->call->Context(),
+                    group->filter_key, group->filter.get());
+                auto next = group;
+                for (; next != ready.end() && next->filter_key == group->filter_key; next++) {
+                    *next->call->Reply() = snapshot->buffer;
+                    next->call->Complete();
+                }
+                dfs_log(LL_DEBUG2) << "Answered " << (next - group) << " parked callbacks at sequence " << snapshot->sequence;
+                group = next;
+            }
+            if (!ready.empty()) {
+                dfs_log(LL_DEBUG2) << "Callback calls: " << CallbackData::CallPool().Acquired() << " served, "
+                    << CallbackData::CallPool().HeapAllocations() << " from the heap, " << CallbackData::CallPool().InUse() << " in flight, "
+                    << files.Size() << " files with state";
             }
         }
     }
@@ -328,30 +1235,120 @@ public:
         }
         auto clientId = string(clientIdV->second.begin(), clientIdV->second.end());
 
-        fileNameToClientIdRW.lock();
-        auto lockClientIdV = fileNameToClientId.find(request->name());
-        string lockClientId;
-        // Lock already exists that isn't held by this client. Fail
-        if (lockClientIdV != fileNameToClientId.end() && (lockClientId = lockClientIdV->second).compare(clientId) != 0){
-            fileNameToClientIdRW.unlock();
+        FileTable::Handle state = files.FindOrInsert(request->name());
+        return AcquireLease(request->name(), state.get(), clientId, response);
+    }
 
+    Status AcquireWriteLocks(
+        ServerContext* context,
+        const FileNames* request,
+        WriteLock* response
+    ) override {
+        const multimap<string_ref, string_ref>& metadata = context->client_metadata();
+        auto clientIdV = metadata.find(ClientIdMetadataKey);
+        if (clientIdV == metadata.end()){
             stringstream ss;
-            ss << "Acquiring lock failed. File " << request->name() << " already has a write lock from client " << lockClientId << " Your id: " << clientId;
+            ss << "Missing " << ClientIdMetadataKey << " in client metadata" << endl;
             dfs_log(LL_ERROR) << ss.str();
-            return Status(StatusCode::RESOURCE_EXHAUSTED, ss.str());
-        // This client already has a lock on this file. In which case just return OK
-        } else if (lockClientId.compare(clientId) == 0) {
-            fileNameToClientIdRW.unlock();
+            return Status(StatusCode::INTERNAL, ss.str());
+        }
+        auto clientId = string(clientIdV->second.begin(), clientIdV->second.end());
 
-            dfs_log(LL_SYSINFO) << "Your client id " << clientId << " already has a lock on " << request->name();
-            return Status::OK;
+        if (request->name_size() > DFS_LOCK_BATCH_MAX) {
+            stringstream ss;
+            ss << "Can't lock " << request->name_size() << " files in one call, the most is " << DFS_LOCK_BATCH_MAX;
+            return Status(StatusCode::INVALID_ARGUMENT, ss.str());
+        }
+
+        // Every caller holding more than one lease_mutex takes them in name order, so two
+        // overlapping batches can't deadlock
+        vector<FileName> names(request->name().begin(), request->name().end());
+        std::sort(names.begin(), names.end());
+        names.erase(std::unique(names.begin(), names.end()), names.end());
+
+        vector<FileTable::Handle> states;
+        states.reserve(names.size());
+        for (const FileName& name : names) {
+            states.push_back(files.FindOrInsert(name));
+        }
+        for (FileTable::Handle& state : states) {
+            state->lease_mutex.lock();
+        }
+
+        // Grant nothing unless every file can be granted
+        for (size_t i = 0; i < names.size(); i++) {
+            const WriteLease* lease = LiveLease(states[i].get());
+            if (lease != nullptr && lease->client_id.compare(clientId) != 0) {
+                string lockClientId = lease->client_id;
+                for (FileTable::Handle& state : states) {
+                    state->lease_mutex.unlock();
+                }
+
+                stringstream ss;
+                ss << "Acquiring " << names.size() << " locks failed. File " << names[i] << " already has a write lock from client "
+                   << lockClientId << " Your id: " << clientId;
+                dfs_log(LL_ERROR) << ss.str();
+                return Status(StatusCode::RESOURCE_EXHAUSTED, ss.str());
+            }
+        }
+        for (size_t i = 0; i < names.size(); i++) {
+            GrantLease(names[i], states[i].get(), clientId, response);
+        }
+        for (FileTable::Handle& state : states) {
+            state->lease_mutex.unlock();
+        }
+
+        dfs_log(LL_DEBUG) << "Granted write leases on " << names.size() << " files to client " << clientId;
+        return Status::OK;
+    }
+
+    Status RenewWriteLock(
+        ServerContext* context,
+        const File* request,
+        WriteLock* response
+    ) override {
+        const multimap<string_ref, string_ref>& metadata = context->client_metadata();
+        auto clientIdV = metadata.find(ClientIdMetadataKey);
+        if (clientIdV == metadata.end()){
+            stringstream ss;
+            ss << "Missing " << ClientIdMetadataKey << " in client metadata" << endl;
+            dfs_log(LL_ERROR) << ss.str();
+            return Status(StatusCode::INTERNAL, ss.str());
+        }
+        auto clientId = string(clientIdV->second.begin(), clientIdV->second.end());
+
+        FileTable::Handle state = files.FindOrInsert(request->name());
+        state->lease_mutex.lock();
+        const WriteLease* lease = LiveLease(state.get());
+        if (lease == nullptr) {
+            state->lease_mutex.unlock();
+
+            stringstream ss;
+            ss << "Renewing lock failed. File " << request->name() << " has no write lock. Your id: " << clientId;
+            dfs_log(LL_ERROR) << ss.str();
+            return Status(StatusCode::NOT_FOUND, ss.str());
+        } else if (lease->client_id.compare(clientId) != 0) {
+            string lockClientId = lease->client_id;
+            state->lease_mutex.unlock();
+
+            stringstream ss;
+            ss << "Renewing lock failed. File " << request->name() << " has a write lock from client " << lockClientId << " Your id: " << clientId;
+            dfs_log(LL_ERROR) << ss.str();
+            return Status(StatusCode::RESOURCE_EXHAUSTED, ss.str());
         }
-        fileNameToClientId[request->name()] = clientId;
-        fileNameToClientIdRW.unlock();
+        GrantLease(request->name(), state.get(), clientId, response);
+        state->lease_mutex.unlock();
 
-        // Add file read write mutex if it doesn't exist
-        AddFileRWMutex(request->name());
+        dfs_log(LL_DEBUG) << "Renewed write lease on " << request->name() << " for client " << clientId;
+        return Status::OK;
+    }
 
+    Status GetStats(
+        ServerContext* context,
+        const Empty* request,
+        Stats* response
+    ) override {
+        CollectStats(response);
         return Status::OK;
     }
 
@@ -390,31 +1387,38 @@ public:
 
         string filePath = WrapPath(fileName);
 
-        fileNameToClientIdRW.lock_shared();
-        auto lockClientIdV = fileNameToClientId.find(fileName);
-        string lockClientId;
-        if (lockClientIdV == fileNameToClientId.end()){
-            fileNameToClientIdRW.unlock_shared();
+        FileTable::Handle state = files.FindOrInsert(fileName);
 
-            stringstream ss;
-            ss << "Your client id " << clientId << " doesn't have a write lock for file " << fileName;
-            dfs_log(LL_ERROR) << ss.str();
-            return Status(StatusCode::INTERNAL, ss.str());
-        } else if ((lockClientId = lockClientIdV->second).compare(clientId) != 0) {
-            fileNameToClientIdRW.unlock_shared();
+        // A write conditional on the version the client last saw needs no lock of its own, but
+        // mustn't go through a lock another client holds
+        auto expectedV = metadata.find(ExpectedVersionMetadataKey);
+        bool conditional = expectedV != metadata.end();
+        uint64 expected = conditional ? stoull(string(expectedV->second.begin(), expectedV->second.end())) : 0;
 
-            stringstream ss;
-            ss << "File " << fileName << " already has a lock from client " << lockClientId << " Your id: " << clientId;
-            dfs_log(LL_ERROR) << ss.str();
-            return Status(StatusCode::INTERNAL, ss.str());
+        // Take the lock as part of this call if the client asked, saving it a round trip
+        if (!conditional && metadata.find(AcquireLockMetadataKey) != metadata.end()) {
+            WriteLock lock;
+            Status acquired = AcquireLease(fileName, state.get(), clientId, &lock);
+            if (!acquired.ok()) {
+                return acquired;
+            }
+            // Tell the client how long the lease is, so a long upload can renew it
+            context->AddInitialMetadata(LeaseMetadataKey, to_string(lock.lease_ms()));
+            reader->SendInitialMetadata();
         }
-        fileNameToClientIdRW.unlock_shared();
 
-        shared_timed_mutex* fileAccessMutex = UnsafeGetFileRWMutex(fileName);
+        Status leased = CheckLease(fileName, state.get(), clientId, conditional);
+        if (!leased.ok()) {
+            return leased;
+        }
 
-        dirMutex.lock();
-        fileAccessMutex->lock();
+        DFSSharedMutex* fileAccessMutex = &state->access;
 
+        // Published versions are never written in place, so a shared lock is enough to compare
+        // against the current one
+        fileAccessMutex->lock_shared();
+        struct stat current;
+        bool exists = stat(filePath.c_str(), &current) == 0;
         Status checkSumResult = verifyChecksum(metadata, filePath);
         if (!checkSumResult.ok()){
             struct stat fs;
@@ -425,70 +1429,124 @@ public:
                 //ub.actime = mtime;
                 if (!utime(filePath.c_str(), &ub)) {
                     dfs_log(LL_SYSINFO) << "Updated " << filePath << " mtime to " << mtime;
+                    PublishChange(ChangeEvent::MODIFIED, fileName, ClientChecksum(metadata));
                 } else {
                     dfs_log(LL_ERROR) << "Updating mtime for " << filePath << " failed with: " << strerror(errno);
                 }
+                exists = stat(filePath.c_str(), &current) == 0;
             }
-            ReleaseClientLock(fileName);
-            fileAccessMutex->unlock();
-            dirMutex.unlock();
+            // Let the client adopt the version it turns out to already have, mtime update and all
+            context->AddTrailingMetadata(VersionMetadataKey, to_string(CurrentVersion(exists ? &current : nullptr)));
+            ReleaseClientLock(state.get(), clientId);
+            fileAccessMutex->unlock_shared();
 
             dfs_log(LL_ERROR) << checkSumResult.error_message();
             return checkSumResult;
         }
+        // Fail fast, before the upload, if the client is writing over a version it hasn't seen
+        uint64 currentVersion = CurrentVersion(exists ? &current : nullptr);
+        if (conditional && currentVersion != expected) {
+            ReleaseClientLock(state.get(), clientId);
+            fileAccessMutex->unlock_shared();
+            return VersionConflict(context, fileName, expected, currentVersion);
+        }
+        fileAccessMutex->unlock_shared();
 
-        dfs_log(LL_SYSINFO) << "Writing file " << filePath << " Client id: " << clientId;
+        // The new version is staged without holding any lock, so readers of the current one
+        // carry on undisturbed, and only becomes visible when it is renamed into place
+        string stagingPath = StagingPath(fileName);
+        dfs_log(LL_SYSINFO) << "Writing file " << filePath << " via " << stagingPath << " Client id: " << clientId;
 
         FileChunk chunk;
         ofstream ofs;
         try {
-            while (reader->Read(&chunk)) {
-                if (!ofs.is_open()) {
-                    ofs.open(filePath, ios::trunc);
-                }
-
-                if (context->IsCancelled()){
-                    ReleaseClientLock(fileName);
-                    fileAccessMutex->unlock();
-                    dirMutex.unlock();
-
-                    const string& err = "Request deadline has expired";
-                    dfs_log(LL_ERROR) << err;
-                    return Status(StatusCode::DEADLINE_EXCEEDED, err);
-                }
-
+            ofs.open(stagingPath, ios::trunc | ios::binary);
+            while (reader->Read(&chunk) && !context->IsCancelled()) {
                 const string& chunkStr = chunk.contents();
                 ofs << chunkStr;
                 dfs_log(LL_SYSINFO) << "Wrote chunk of size " << chunkStr.length();
             }
+            // A cancelled upload ends its stream just like a finished one, so it has to be
+            // checked for after the last read too or it would be published cut short
+            if (context->IsCancelled()){
+                ofs.close();
+                unlink(stagingPath.c_str());
+                ReleaseClientLock(state.get(), clientId);
+
+                const string& err = "Request deadline has expired";
+                dfs_log(LL_ERROR) << err;
+                return Status(StatusCode::DEADLINE_EXCEEDED, err);
+            }
             ofs.close();
-            ReleaseClientLock(fileName);
+            if (ofs.fail()) {
+                throw runtime_error(strerror(errno));
+            }
         } catch (exception const& e) {
-            ReleaseClientLock(fileName);
-            fileAccessMutex->unlock();
-            dirMutex.unlock();
+            unlink(stagingPath.c_str());
+            ReleaseClientLock(state.get(), clientId);
 
             stringstream ss;
             ss << "Error writing to file " << e.what() << endl;
             dfs_log(LL_ERROR) << ss.str();
             return Status(StatusCode::INTERNAL, ss.str());
         }
-        FileStatus fs;
-        if (getStat(filePath, &fs) != 0) {
+
+        // Publish. Readers that already opened the old version keep streaming it, and its
+        // storage is reclaimed when the last of them closes it
+        dirMutex.lock();
+        fileAccessMutex->lock();
+        struct stat existing;
+        bool existed = stat(filePath.c_str(), &existing) == 0;
+        // The lease may have run out while the upload was staged, and gone to another client
+        // that has published since. Only a write still entitled to go through is published
+        leased = CheckLease(fileName, state.get(), clientId, conditional);
+        if (!leased.ok()) {
+            fileAccessMutex->unlock();
+            dirMutex.unlock();
+            unlink(stagingPath.c_str());
+            return leased;
+        }
+        // Someone may have published while this upload was staged
+        currentVersion = CurrentVersion(existed ? &existing : nullptr);
+        if (conditional && currentVersion != expected) {
+            ReleaseClientLock(state.get(), clientId);
+            fileAccessMutex->unlock();
+            dirMutex.unlock();
+            unlink(stagingPath.c_str());
+            return VersionConflict(context, fileName, expected, currentVersion);
+        }
+        struct stat written;
+        if (rename(stagingPath.c_str(), filePath.c_str()) != 0 || stat(filePath.c_str(), &written) != 0) {
+            int error = errno;
             fileAccessMutex->unlock();
             dirMutex.unlock();
+            unlink(stagingPath.c_str());
+            ReleaseClientLock(state.get(), clientId);
 
             stringstream ss;
-            ss << "Getting file info for file " << filePath << " failed with: " << strerror(errno) << endl;
+            ss << "Publishing file " << filePath << " failed with: " << strerror(error) << endl;
             dfs_log(LL_ERROR) << ss.str();
-            return Status(StatusCode::NOT_FOUND, ss.str());
+            return Status(StatusCode::INTERNAL, ss.str());
         }
+        // Two publishes within one tick of a coarse filesystem clock would share a change time,
+        // and so a version. Touching the file once the tick is over moves it on
+        while (CurrentVersion(&written) <= currentVersion) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            struct timespec times[2] = {written.st_atim, written.st_mtim};
+            if (utimensat(AT_FDCWD, filePath.c_str(), times, 0) != 0 || stat(filePath.c_str(), &written) != 0) {
+                dfs_log(LL_ERROR) << "Moving on the change time of " << filePath << " failed with: " << strerror(errno);
+                break;
+            }
+        }
+        uint64 version = CurrentVersion(&written);
         fileAccessMutex->unlock();
         dirMutex.unlock();
+        ReleaseClientLock(state.get(), clientId);
+        PublishChange(existed ? ChangeEvent::MODIFIED : ChangeEvent::CREATED, fileName, ClientChecksum(metadata));
 
         response->set_name(fileName);
-        Timestamp* modified = new Timestamp(fs.modified());
-        response->set_allocated_modified(modified);
+        response->mutable_modified()->set_seconds(written.st_mtime);
+        response->set_version(version);
         return Status::OK;
     }
 
@@ -499,19 +1557,23 @@ public:
     ) override {
         string filePath = WrapPath(request->name());
         
-        AddFileRWMutex(request->name());
-        shared_timed_mutex* fileAccessMutex = UnsafeGetFileRWMutex(request->name());
+        FileTable::Handle state = files.FindOrInsert(request->name());
+        DFSSharedMutex* fileAccessMutex = &state->access;
 
-        fileAccessMutex->lock();
+        // The lock is only held until the current version is open. Writers publish by renaming
+        // a new version into place, so the stream below keeps reading the version opened here
+        fileAccessMutex->lock_shared();
         struct stat fs;
         if (stat(filePath.c_str(), &fs) != 0){
-            fileAccessMutex->unlock();
+            fileAccessMutex->unlock_shared();
 
             stringstream ss;
             ss << "File " << filePath << " does not exist" << endl;
             dfs_log(LL_ERROR) << ss.str();
             return Status(StatusCode::NOT_FOUND, ss.str());
         }
+        // Tell the client which version it is getting, or already has
+        context->AddInitialMetadata(VersionMetadataKey, to_string(CurrentVersion(&fs)));
 
         Status checkSumResult = verifyChecksum(context->client_metadata(), filePath);
         if (!checkSumResult.ok()){
@@ -520,7 +1582,7 @@ public:
                 const multimap<string_ref, string_ref>& metadata = context->client_metadata();
                 auto mtimeV = metadata.find(MtimeMetadataKey);
                 if (mtimeV == metadata.end()){
-                    fileAccessMutex->unlock();
+                    fileAccessMutex->unlock_shared();
 
                     stringstream ss;
                     ss << "Missing " << MtimeMetadataKey << " in client metadata" << endl;
@@ -536,22 +1598,22 @@ public:
                     ub.actime = mtime;
                     if (!utime(filePath.c_str(), &ub)) {
                         dfs_log(LL_SYSINFO) << "Updated " << filePath << " mtime to " << mtime;
+                        PublishChange(ChangeEvent::MODIFIED, request->name(), ClientChecksum(metadata));
                     }
                 }
             }
 
-            fileAccessMutex->unlock();
+            fileAccessMutex->unlock_shared();
             dfs_log(LL_ERROR) << checkSumResult.error_message();
             return checkSumResult;
         }
-        fileAccessMutex->unlock();
 
-        fileAccessMutex->lock_shared();
         dfs_log(LL_SYSINFO) << "Retrieving file " << filePath;
 
         int fileSize = fs.st_size;
         
-        ifstream ifs(filePath);
+        ifstream ifs(filePath, ios::binary);
+        fileAccessMutex->unlock_shared();
         FileChunk chunk;
         try {
             int bytesSent = 0;
@@ -559,28 +1621,23 @@ public:
                 int bytesToSend = min(fileSize - bytesSent, ChunkSize);
                 char buffer[ChunkSize];
                 if (context->IsCancelled()){
-                    fileAccessMutex->unlock_shared();
-
                     const string& err = "Request deadline has expired";
                     dfs_log(LL_ERROR) << err;
                     return Status(StatusCode::DEADLINE_EXCEEDED, err);
                 }
                 ifs.read(buffer, bytesToSend);
-                chunk.set_contents(buffer, bytesToSend);
+                chunk.set_contents(static_cast<const char*>(buffer), bytesToSend);
                 writer->Write(chunk);
                 dfs_log(LL_SYSINFO) << "Returned chunk of size " << bytesToSend << " bytes";
                 bytesSent += bytesToSend;
             }
             ifs.close();
-            fileAccessMutex->unlock_shared();
             if (bytesSent != fileSize) {
                 stringstream ss;
                 ss << "The impossible happened" << endl;
                 return Status(StatusCode::INTERNAL, ss.str());
             }
         } catch (exception const& e) {
-            fileAccessMutex->unlock_shared();
-
             stringstream ss;
             ss << "Error reading file " << e.what() << endl;
             dfs_log(LL_ERROR) << ss.str();
@@ -610,36 +1667,38 @@ public:
         }
         auto clientId = string(clientIdV->second.begin(), clientIdV->second.end());
         
-        AddFileRWMutex(request->name());
-        shared_timed_mutex* fileAccessMutex = UnsafeGetFileRWMutex(request->name());
-
-        fileNameToClientIdRW.lock_shared();
-        string lockClientId;
-        auto lockClientIdV = fileNameToClientId.find(request->name());
-        if (lockClientIdV == fileNameToClientId.end()){
-            fileNameToClientIdRW.unlock_shared();
-
-            stringstream ss;
-            ss << "Your client id " << clientId << " doesn't have a write lock for file " << request->name();
-            dfs_log(LL_ERROR) << ss.str();
-            return Status(StatusCode::INTERNAL, ss.str());
-        } else if ((lockClientId = lockClientIdV->second).compare(clientId) != 0) {
-            fileNameToClientIdRW.unlock_shared();
-
-            stringstream ss;
-            ss << "File " << request->name() << " already has a lock from client " << lockClientId << ". Your id: " << clientId;
-            dfs_log(LL_ERROR) << ss.str();
-            return Status(StatusCode::INTERNAL, ss.str());
+        FileTable::Handle state = files.FindOrInsert(request->name());
+        DFSSharedMutex* fileAccessMutex = &state->access;
+
+        // A delete conditional on the version the client last saw needs no lock of its own, but
+        // mustn't go through a lock another client holds
+        auto expectedV = metadata.find(ExpectedVersionMetadataKey);
+        bool conditional = expectedV != metadata.end();
+        uint64 expected = conditional ? stoull(string(expectedV->second.begin(), expectedV->second.end())) : 0;
+
+        // Take the lock as part of this call if the client asked, saving it a round trip
+        if (!conditional && metadata.find(AcquireLockMetadataKey) != metadata.end()) {
+            WriteLock lock;
+            Status acquired = AcquireLease(request->name(), state.get(), clientId, &lock);
+            if (!acquired.ok()) {
+                return acquired;
+            }
         }
-        fileNameToClientIdRW.unlock_shared();
 
         dfs_log(LL_SYSINFO) << "Deleting file " << filePath;
         dirMutex.lock();
         fileAccessMutex->lock();
+        // Checked under the file's lock, so the lease can't change hands before the delete
+        Status leased = CheckLease(request->name(), state.get(), clientId, conditional);
+        if (!leased.ok()) {
+            fileAccessMutex->unlock();
+            dirMutex.unlock();
+            return leased;
+        }
         // File doesnt exist
-        FileStatus fs;
-        if (getStat(filePath, &fs) != 0) {
-            ReleaseClientLock(request->name());
+        struct stat existing;
+        if (stat(filePath.c_str(), &existing) != 0) {
+            ReleaseClientLock(state.get(), clientId);
             fileAccessMutex->unlock();
             dirMutex.unlock();
 
@@ -648,8 +1707,15 @@ public:
             dfs_log(LL_ERROR) << ss.str();
             return Status(StatusCode::NOT_FOUND, ss.str());
         }
+        uint64 currentVersion = CurrentVersion(&existing);
+        if (conditional && currentVersion != expected) {
+            ReleaseClientLock(state.get(), clientId);
+            fileAccessMutex->unlock();
+            dirMutex.unlock();
+            return VersionConflict(context, request->name(), expected, currentVersion);
+        }
         if (context->IsCancelled()){
-            ReleaseClientLock(request->name());
+            ReleaseClientLock(state.get(), clientId);
             fileAccessMutex->unlock();
             dirMutex.unlock();
 
@@ -659,7 +1725,7 @@ public:
         }
         // Delete file
         if (remove(filePath.c_str()) != 0) {
-            ReleaseClientLock(request->name());
+            ReleaseClientLock(state.get(), clientId);
             fileAccessMutex->unlock();
             dirMutex.unlock();
 
@@ -667,13 +1733,13 @@ public:
             ss << "Removing file " << filePath << " failed with: " << strerror(errno) << endl;
             return Status(StatusCode::INTERNAL, ss.str());
         }
-        ReleaseClientLock(request->name());
+        ReleaseClientLock(state.get(), clientId);
         fileAccessMutex->unlock();
         dirMutex.unlock();
+        PublishChange(ChangeEvent::DELETED, request->name(), 0);
 
         response->set_name(request->name());
-        Timestamp* modified = new Timestamp(fs.modified());
-        response->set_allocated_modified(modified);
+        response->mutable_modified()->set_seconds(existing.st_mtime);
         dfs_log(LL_SYSINFO) << "Deleted file successfully";
         return Status::OK;
     }
@@ -683,58 +1749,7 @@ public:
         const Empty* request,
         Files* response
     ) override {
-        dirMutex.lock_shared();
-        DIR *dir;
-        if ((dir = opendir(mount_path.c_str())) == NULL) {
-            dirMutex.unlock_shared();
-
-            // could not open directory 
-            dfs_log(LL_ERROR) << "Failed to open directory at mount path " << mount_path;
-            return Status::OK;
-        }
-        // traverse everything in directory 
-        struct dirent *ent;
-        while ((ent = readdir(dir)) != NULL) {
-            // TODO: Leaving this out for simplicity since it throws an exception via async calls
-            /*if (context->IsCancelled()){
-                dirMutex.unlock_shared();
-
-                const string& err = "Request deadline has expired";
-                dfs_log(LL_ERROR) << err;
-                return Status(StatusCode::DEADLINE_EXCEEDED, err);
-            }*/
-            struct stat path_stat;
-            string dirEntry(ent->d_name);
-            string path = WrapPath(dirEntry);
-            stat(path.c_str(), &path_stat);
-            // if dir item is a file
-            if (!S_ISREG(path_stat.st_mode)){
-                dfs_log(LL_DEBUG2) << "Found dir at " << path << " - Skipping";
-                continue;
-            }
-            dfs_log(LL_DEBUG2) << "Found file at " << path;
-            FileStatus* ack = response->add_file();
-            FileStatus status;
-            if (getStat(path, &status) != 0) {
-                dirMutex.unlock_shared();
-
-                stringstream ss;
-                ss << "Getting file info for file " << path << " failed with: " << strerror(errno) << endl;
-                dfs_log(LL_ERROR) << ss.str();
-                return Status(StatusCode::NOT_FOUND, ss.str());
-            }
-            
-           ack->set_name(dirEntry);
-           Timestamp* modified = new Timestamp(status.modified());
-           Timestamp* created = new Timestamp(status.created());
-           ack->set_allocated_created(created);
-           ack->set_allocated_modified(modified);
-           ack->set_size(status.size());
-        }
-        closedir(dir);
-        dirMutex.unlock_shared();
-
-        return Status::OK;
+        return FilteredListing(context, nullptr, response);
     }
 
     Status GetFileStatus(
@@ -750,12 +1765,13 @@ public:
 
         string filePath = WrapPath(request->name());
 
-        AddFileRWMutex(request->name());
-        shared_timed_mutex* fileAccessMutex = UnsafeGetFileRWMutex(request->name());
+        FileTable::Handle state = files.FindOrInsert(request->name());
+        DFSSharedMutex* fileAccessMutex = &state->access;
         
         fileAccessMutex->lock_shared();
         /* Get FileStatus of file */
-        if (getStat(filePath, response) != 0) {
+        struct stat fs;
+        if (stat(filePath.c_str(), &fs) != 0) {
             fileAccessMutex->unlock_shared();
 
             stringstream ss;
@@ -763,6 +1779,9 @@ public:
             dfs_log(LL_ERROR) << ss.str();
             return Status(StatusCode::NOT_FOUND, ss.str());
         }
+        fillFileStatus(fs, response);
+        response->set_name(filePath);
+        response->set_version(CurrentVersion(&fs));
         fileAccessMutex->unlock_shared();
 
         return Status::OK;
@@ -770,12 +1789,93 @@ public:
 
     Status CallbackList(
         ServerContext* context,
-        const File* request,
+        const CallbackRequest* request,
         Files* response
     ) override {
-        dfs_log(LL_DEBUG2) << "Handling CallbackList call. Filename: " << request->name();
-        Empty req;
-        return this->ListFiles(context, &req, response);
+        dfs_log(LL_DEBUG2) << "Handling CallbackList call. Client sequence: " << request->sequence();
+        string filterKey;
+        std::shared_ptr<const FileNameMatcher> filter = CompileFilter(request->filter(), &filterKey);
+        Status status = FilteredListing(context, filter.get(), response);
+        AddTombstones(filter.get(), response);
+        return status;
+    }
+
+    Status Subscribe(
+        ServerContext* context,
+        const SubscribeRequest* request,
+        ServerWriter<ChangeEvent>* writer
+    ) override {
+        uint64 cursor = request->sequence();
+        dfs_log(LL_SYSINFO) << "Subscriber connected at sequence " << cursor;
+        string filterKey;
+        std::shared_ptr<const FileNameMatcher> filter = CompileFilter(request->filter(), &filterKey);
+        {
+            std::lock_guard<DFSMutex> lock(queue_mutex);
+            if (NeedsResync(cursor) && !resync_admission.TryTake()) {
+                dfs_log(LL_SYSINFO) << "Turning away subscriber needing a full resync from sequence " << cursor;
+                return Status(StatusCode::RESOURCE_EXHAUSTED, "Too many clients resyncing. Back off and retry");
+            }
+            RecordAck(request->client_id(), cursor);
+            subscriber_count++;
+        }
+
+        bool connected = true;
+        while (connected && !context->IsCancelled()) {
+            vector<ChangeEvent> events;
+            uint64 caught_up = cursor;
+            {
+                std::unique_lock<DFSMutex> lock(queue_mutex);
+                // Everything up to the cursor was written to the stream
+                RecordAck(request->client_id(), cursor);
+                subscriber_cv.wait_for(lock, std::chrono::milliseconds(DFS_HEARTBEAT_INTERVAL),
+                    [this, cursor, context]{ return change_sequence != cursor || context->IsCancelled(); });
+
+                if (NeedsResync(cursor)) {
+                    // The events after the cursor are gone (or the cursor is from before a restart)
+                    ChangeEvent resync;
+                    resync.set_type(ChangeEvent::RESYNC);
+                    resync.set_sequence(change_sequence);
+                    events.push_back(std::move(resync));
+                    if (!request->client_id().empty()) {
+                        resync_grants.insert(request->client_id());
+                    }
+                } else if (cursor < change_sequence) {
+                    // Sequences in the log are contiguous, so the cursor maps straight to an offset
+                    auto first = change_log.begin() + (cursor - change_log_start);
+                    if (filter) {
+                        std::copy_if(first, change_log.end(), std::back_inserter(events),
+                            [&filter](const ChangeEvent& event) { return filter->Matches(event.name()); });
+                    } else {
+                        events.assign(first, change_log.end());
+                    }
+                    caught_up = change_sequence;
+                } else {
+                    ChangeEvent heartbeat;
+                    heartbeat.set_type(ChangeEvent::HEARTBEAT);
+                    heartbeat.set_sequence(cursor);
+                    events.push_back(std::move(heartbeat));
+                }
+            }
+
+            for (const ChangeEvent& event : events) {
+                if (!writer->Write(event)) {
+                    dfs_log(LL_SYSINFO) << "Subscriber at sequence " << cursor << " went away";
+                    connected = false;
+                    break;
+                }
+                cursor = event.sequence();
+            }
+            // Skip past the changes the filter dropped as well
+            if (connected) {
+                cursor = std::max(cursor, caught_up);
+            }
+        }
+        {
+            std::lock_guard<DFSMutex> lock(queue_mutex);
+            subscriber_count--;
+            resync_grants.erase(request->client_id());
+        }
+        return Status::OK;
     }
 
 
@@ -803,6 +1903,12 @@ DFSServerNode::DFSServerNode(const std::string &server_address,
         server_address(server_address),
         mount_path(mount_path),
         num_async_threads(num_async_threads),
+        callback_hold_timeout(DFS_CALLBACK_HOLD_TIMEOUT),
+        coalesce_window(DFS_COALESCE_WINDOW),
+        resync_rate(DFS_RESYNC_RATE),
+        resync_burst(DFS_RESYNC_BURST),
+        write_lease(DFS_WRITE_LEASE),
+        stats_interval(DFS_STATS_INTERVAL),
         grader_callback(callback) {}
 /**
  * Server shutdown
@@ -815,7 +1921,9 @@ DFSServerNode::~DFSServerNode() noexcept {
  * Start the DFSServerNode server
  */
 void DFSServerNode::Start() {
-    DFSServiceImpl service(this->mount_path, this->server_address, this->num_async_threads);
+    DFSServiceImpl service(this->mount_path, this->server_address, this->num_async_threads, this->callback_hold_timeout,
+        this->coalesce_window, this->resync_rate, this->resync_burst,
+        this->write_lease, this->stats_interval);
 
 
     dfs_log(LL_SYSINFO) << "DFSServerNode server listening on " << this->server_address;
@@ -827,3 +1935,24 @@ void DFSServerNode::Start() {
 //
 // Add your additional definitions here
 //
+
+void DFSServerNode::SetCallbackHoldTimeout(int timeout) {
+    this->callback_hold_timeout = timeout;
+}
+
+void DFSServerNode::SetCoalesceWindow(int window) {
+    this->coalesce_window = window;
+}
+
+void DFSServerNode::SetResyncLimit(double rate, int burst) {
+    this->resync_rate = rate;
+    this->resync_burst = burst;
+}
+
+void DFSServerNode::SetWriteLease(int lease) {
+    this->write_lease = lease;
+}
+
+void DFSServerNode::SetStatsInterval(int interval) {
+    this->stats_interval = interval;
+}
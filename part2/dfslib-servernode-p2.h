@@ -25,6 +25,22 @@ private:
     /** Number of asynchronous threads to use **/
     int num_async_threads;
 
+    /** The longest a CallbackList call is held waiting for a change, in milliseconds **/
+    int callback_hold_timeout;
+
+    /** How long a file must go unchanged before its change is published, in milliseconds **/
+    int coalesce_window;
+
+    /** Full resyncs admitted per second, and in a burst **/
+    double resync_rate;
+    int resync_burst;
+
+    /** How long a write lock is held unless renewed, in milliseconds **/
+    int write_lease;
+
+    /** How often the lock and queue stats are logged, in milliseconds. 0 turns it off **/
+    int stats_interval;
+
     /** Server callback **/
     std::function<void()> grader_callback;
 
@@ -36,6 +52,11 @@ public:
     ~DFSServerNode();
     void Shutdown();
     void Start();
+    void SetCallbackHoldTimeout(int timeout);
+    void SetCoalesceWindow(int window);
+    void SetResyncLimit(double rate, int burst);
+    void SetWriteLease(int lease);
+    void SetStatsInterval(int interval);
 };
 
 #endif
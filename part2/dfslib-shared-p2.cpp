@@ -2,12 +2,20 @@
 #include <iostream>
 #include <fstream>
 #include <cstddef>
+#include <sstream>
+#include <stdexcept>
+#include <ctime>
 #include <sys/stat.h>
+#include <fnmatch.h>
 
 #include "dfslib-shared-p2.h"
 #include "proto-src/dfs-service.grpc.pb.h"
+#include "src/dfslibx-lock-stats.h"
 
 using dfs_service::FileStatus;
+using dfs_service::LockStats;
+using dfs_service::Stats;
+using dfs_service::SubscriptionFilter;
 using google::protobuf::util::TimeUtil;
 using google::protobuf::Timestamp;
 
@@ -33,6 +41,10 @@ const char* ClientIdMetadataKey = "client_id";
 const char* FileNameMetadataKey = "file_name";
 const char* CheckSumMetadataKey = "checksum";
 const char* MtimeMetadataKey = "mtime";
+const char* AcquireLockMetadataKey = "acquire_lock";
+const char* LeaseMetadataKey = "lease_ms";
+const char* ExpectedVersionMetadataKey = "expected_version";
+const char* VersionMetadataKey = "version";
 
 int ChunkSize = 5120;
 
@@ -42,11 +54,318 @@ int getStat(string path, FileStatus* fs) {
     if (stat(path.c_str(), &result) != 0){
         return -1;
     }
-    Timestamp* modified = new Timestamp(TimeUtil::TimeTToTimestamp(result.st_mtime));
-    Timestamp* created = new Timestamp(TimeUtil::TimeTToTimestamp(result.st_ctime));
-    fs->set_allocated_modified(modified);
-    fs->set_allocated_created(created);
-    fs->set_size(result.st_size);
+    fillFileStatus(result, fs);
     fs->set_name(path);
     return 0;
-}
\ No newline at end of file
+}
+
+/*
+ * fillFileStatus copies the fields of an existing `stat` result we care about into a `FileStatus`.
+ * The timestamps are filled in place, so they come from the same arena as `fs` when it has one
+ */
+void fillFileStatus(const struct stat& result, FileStatus* fs) {
+    fs->mutable_modified()->set_seconds(result.st_mtime);
+    fs->mutable_created()->set_seconds(result.st_ctime);
+    fs->set_size(result.st_size);
+}
+
+void fillLockStats(Stats* stats) {
+    for (const DFSLockClass::Snapshot& snapshot : DFSLockClass::TakeAll(DFS_STATS_TOP_CONTENDED)) {
+        LockStats* lock = stats->add_lock();
+        lock->set_name(snapshot.name);
+        lock->set_acquisitions(snapshot.acquisitions);
+        lock->set_contended(snapshot.contended);
+        lock->set_wait_us(snapshot.wait_ns / 1000);
+        lock->set_hold_us(snapshot.hold_ns / 1000);
+        for (std::size_t i = 0; i < DFSLockClass::Buckets; i++) {
+            lock->add_wait_histogram(snapshot.wait_histogram[i]);
+            lock->add_hold_histogram(snapshot.hold_histogram[i]);
+        }
+        for (const DFSLockClass::Contention& contention : snapshot.top_contended) {
+            dfs_service::ContendedLock* contended = lock->add_top_contended();
+            contended->set_name(contention.label);
+            contended->set_contended(contention.contended);
+            contended->set_wait_us(contention.wait_ns / 1000);
+        }
+    }
+}
+
+// The upper edge, in microseconds, of the histogram bucket holding the given fraction of samples
+static std::uint64_t histogramPercentile(const google::protobuf::RepeatedField<google::protobuf::uint64>& histogram, double fraction) {
+    std::uint64_t total = 0;
+    for (google::protobuf::uint64 count : histogram) {
+        total += count;
+    }
+    std::uint64_t seen = 0;
+    for (int i = 0; i < histogram.size(); i++) {
+        seen += histogram.Get(i);
+        if (total != 0 && seen >= fraction * total) {
+            return std::uint64_t(1) << i;
+        }
+    }
+    return 0;
+}
+
+string formatStats(const Stats& stats) {
+    std::stringstream ss;
+    for (const LockStats& lock : stats.lock()) {
+        if (lock.acquisitions() == 0) {
+            continue;
+        }
+        ss << lock.name() << ": " << lock.acquisitions() << " acquired, " << lock.contended() << " contended, waited "
+           << lock.wait_us() << "us (p99 <" << histogramPercentile(lock.wait_histogram(), 0.99) << "us), held "
+           << lock.hold_us() << "us (p50 <" << histogramPercentile(lock.hold_histogram(), 0.5) << "us, p99 <"
+           << histogramPercentile(lock.hold_histogram(), 0.99) << "us)";
+        for (const dfs_service::ContendedLock& contended : lock.top_contended()) {
+            ss << "\n    " << contended.name() << ": " << contended.contended() << " contended, waited " << contended.wait_us() << "us";
+        }
+        ss << "\n";
+    }
+    for (const dfs_service::Counter& counter : stats.counter()) {
+        ss << counter.name() << ": " << counter.value() << "\n";
+    }
+    return ss.str();
+}
+
+FileNameMatcher::FileNameMatcher(const SubscriptionFilter& filter) {
+    for (const string& pattern : filter.include()) {
+        include.Add(pattern);
+    }
+    for (const string& pattern : filter.exclude()) {
+        exclude.Add(pattern);
+    }
+}
+
+bool FileNameMatcher::Matches(const string& name) const {
+    if (exclude.Matches(name)) {
+        return false;
+    }
+    return include.Empty() || include.Matches(name);
+}
+
+string FileNameMatcher::Key(const SubscriptionFilter& filter) {
+    std::vector<string> include(filter.include().begin(), filter.include().end());
+    std::vector<string> exclude(filter.exclude().begin(), filter.exclude().end());
+    std::sort(include.begin(), include.end());
+    std::sort(exclude.begin(), exclude.end());
+
+    // File names can't hold a NUL, so it separates the patterns unambiguously
+    string key;
+    for (const string& pattern : include) {
+        key.append("+").append(pattern).push_back('\0');
+    }
+    for (const string& pattern : exclude) {
+        key.append("-").append(pattern).push_back('\0');
+    }
+    return key;
+}
+
+void FileNameMatcher::Rules::Add(const string& pattern) {
+    size_t wildcard = pattern.find_first_of("*?[");
+    if (wildcard == string::npos) {
+        exact.insert(pattern);
+    } else if (wildcard == pattern.size() - 1 && pattern.back() == '*') {
+        prefixes.push_back(pattern.substr(0, wildcard));
+    } else {
+        globs.push_back(pattern);
+    }
+}
+
+bool FileNameMatcher::Rules::Empty() const {
+    return exact.empty() && prefixes.empty() && globs.empty();
+}
+
+bool FileNameMatcher::Rules::Matches(const string& name) const {
+    if (exact.count(name)) {
+        return true;
+    }
+    for (const string& prefix : prefixes) {
+        if (name.compare(0, prefix.size(), prefix) == 0) {
+            return true;
+        }
+    }
+    for (const string& glob : globs) {
+        if (fnmatch(glob.c_str(), name.c_str(), 0) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+TokenBucket::TokenBucket(double rate, double burst) :
+    rate(rate), burst(burst), tokens(burst), refilled(std::chrono::steady_clock::now()) {}
+
+bool TokenBucket::TryTake(double tokens) {
+    std::lock_guard<std::mutex> lock(mutex);
+    Refill();
+    if (this->tokens < tokens) {
+        return false;
+    }
+    this->tokens -= tokens;
+    return true;
+}
+
+void TokenBucket::Refill() {
+    auto now = std::chrono::steady_clock::now();
+    std::chrono::duration<double> elapsed = now - refilled;
+    tokens = std::min(burst, tokens + elapsed.count() * rate);
+    refilled = now;
+}
+
+std::chrono::duration<double> TokenBucket::Reserve(double tokens) {
+    std::lock_guard<std::mutex> lock(mutex);
+    Refill();
+    this->tokens -= tokens;
+    if (this->tokens >= 0 || rate <= 0) {
+        return std::chrono::duration<double>::zero();
+    }
+    return std::chrono::duration<double>(-this->tokens / rate);
+}
+
+void TokenBucket::Reset(double rate, double burst) {
+    std::lock_guard<std::mutex> lock(mutex);
+    Refill();
+    // A bigger bucket gains the extra room. An unlimited one doesn't refill, so leave it full
+    // for when a limit comes back
+    this->tokens = rate > 0 ? std::min(this->tokens + std::max(burst - this->burst, 0.0), burst) : burst;
+    this->rate = rate;
+    this->burst = burst;
+}
+
+RateSchedule::RateSchedule() : default_rate(0) {}
+
+bool RateSchedule::ParseRate(const std::string& text, double* rate) {
+    if (text.empty()) {
+        return false;
+    }
+    double multiplier = 1;
+    std::string number = text;
+    switch (std::tolower(static_cast<unsigned char>(number.back()))) {
+        case 'k': multiplier = 1024; break;
+        case 'm': multiplier = 1024 * 1024; break;
+        case 'g': multiplier = 1024 * 1024 * 1024; break;
+    }
+    if (multiplier != 1) {
+        number.pop_back();
+    }
+    try {
+        std::size_t used;
+        double value = std::stod(number, &used);
+        if (used != number.size() || !(value >= 0)) {
+            return false;
+        }
+        *rate = value * multiplier;
+        return true;
+    } catch (const std::exception&) {
+        return false;
+    }
+}
+
+bool RateSchedule::ParseTime(const std::string& text, int* minutes) {
+    int hours, mins;
+    char colon;
+    std::istringstream in(text);
+    if (!(in >> hours >> colon >> mins) || colon != ':' || !in.eof() || hours < 0 || hours > 24 || mins < 0 || mins > 59
+            || (hours == 24 && mins != 0)) {
+        return false;
+    }
+    *minutes = hours * 60 + mins;
+    return true;
+}
+
+bool RateSchedule::Parse(const std::string& spec, RateSchedule* schedule) {
+    RateSchedule parsed;
+    std::istringstream in(spec);
+    std::string part;
+    bool first = true;
+    while (std::getline(in, part, ',')) {
+        if (first) {
+            first = false;
+            if (!ParseRate(part, &parsed.default_rate)) {
+                return false;
+            }
+            continue;
+        }
+        std::size_t dash = part.find('-');
+        std::size_t equals = part.find('=');
+        Window window;
+        if (dash == std::string::npos || equals == std::string::npos || equals < dash
+                || !ParseTime(part.substr(0, dash), &window.start)
+                || !ParseTime(part.substr(dash + 1, equals - dash - 1), &window.end)
+                || !ParseRate(part.substr(equals + 1), &window.rate)) {
+            return false;
+        }
+        parsed.windows.push_back(window);
+    }
+    if (first) {
+        return false;
+    }
+    *schedule = parsed;
+    return true;
+}
+
+double RateSchedule::RateAt(std::time_t when) const {
+    if (windows.empty()) {
+        return default_rate;
+    }
+    struct tm local;
+    localtime_r(&when, &local);
+    int minutes = local.tm_hour * 60 + local.tm_min;
+    for (const Window& window : windows) {
+        bool inside = window.start <= window.end ?
+            minutes >= window.start && minutes < window.end :
+            minutes >= window.start || minutes < window.end;
+        if (inside) {
+            return window.rate;
+        }
+    }
+    return default_rate;
+}
+
+bool RateSchedule::Unlimited() const {
+    if (default_rate > 0) {
+        return false;
+    }
+    for (const Window& window : windows) {
+        if (window.rate > 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+Throttle::Throttle() : burst(DFS_THROTTLE_BURST), bucket(0, DFS_THROTTLE_BURST), rate(0) {}
+
+void Throttle::Configure(const RateSchedule& schedule, double burst) {
+    this->schedule = schedule;
+    this->burst = burst;
+    rate = schedule.RateAt(std::time(nullptr));
+    rate_checked = std::chrono::steady_clock::now();
+    bucket.Reset(rate, burst);
+}
+
+bool Throttle::Unlimited() const {
+    return schedule.Unlimited();
+}
+
+std::chrono::duration<double> Throttle::Delay(std::size_t bytes) {
+    if (schedule.Unlimited()) {
+        return std::chrono::duration<double>::zero();
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto now = std::chrono::steady_clock::now();
+        if (now - rate_checked >= std::chrono::seconds(1)) {
+            rate_checked = now;
+            double scheduled = schedule.RateAt(std::time(nullptr));
+            if (scheduled != rate) {
+                rate = scheduled;
+                bucket.Reset(rate, burst);
+            }
+        }
+        if (rate <= 0) {
+            return std::chrono::duration<double>::zero();
+        }
+    }
+    return bucket.Reserve(bytes);
+}
@@ -10,6 +10,11 @@
 #include <fstream>
 #include <string>
 #include <thread>
+#include <vector>
+#include <unordered_set>
+#include <mutex>
+#include <chrono>
+#include <ctime>
 #include <sys/stat.h>
 
 #include "src/dfs-utils.h"
@@ -57,15 +62,307 @@ struct EventStruct {
 // Add any additional shared code here
 //
 
+/** Default longest time, in milliseconds, the server holds a CallbackList call waiting for a change **/
+#define DFS_CALLBACK_HOLD_TIMEOUT 30000
+
+/** How often, in milliseconds, an idle Subscribe stream carries a heartbeat **/
+#define DFS_HEARTBEAT_INTERVAL 5000
+
+/** A Subscribe stream that carries nothing, not even a heartbeat, for this many intervals is taken for dead **/
+#define DFS_HEARTBEAT_MISSES 3
+
+/** How many change events the server keeps for Subscribe streams to resume from **/
+#define DFS_CHANGE_LOG_SIZE 4096
+
+/** Default quiet time, in milliseconds, a file must see no further changes before its change is published **/
+#define DFS_COALESCE_WINDOW 200
+
+/** A file that keeps changing is published anyway once this many coalescing windows pass its first change **/
+#define DFS_COALESCE_MAX_WINDOWS 10
+
+/** How many compiled client filters the server keeps before forgetting unused ones **/
+#define DFS_FILTER_CACHE_SIZE 256
+
+/** First reconnect delay, in milliseconds, after the server can't be reached **/
+#define DFS_BACKOFF_BASE 250
+
+/** Longest reconnect delay, in milliseconds, however many attempts have failed **/
+#define DFS_BACKOFF_MAX 30000
+
+/** Default full resyncs the server admits per second, and how many it admits in a burst **/
+#define DFS_RESYNC_RATE 5
+#define DFS_RESYNC_BURST 10
+
+/**
+ * Block sizes, in bytes, for the per-thread arena listings are built on. Each thread keeps the
+ * initial block for good, and large blocks keep even a huge listing to a handful of allocations
+ */
+#define DFS_LISTING_ARENA_INITIAL_BLOCK (256 * 1024)
+#define DFS_LISTING_ARENA_MAX_BLOCK (4 * 1024 * 1024)
+
+/** How often, in milliseconds, the server drops tombstones every client has acknowledged **/
+#define DFS_TOMBSTONE_COMPACT_INTERVAL 1000
+
+/** A client not heard from for this long, in milliseconds, no longer holds back tombstone compaction **/
+#define DFS_CLIENT_ACK_TIMEOUT 600000
+
+/** Default time, in milliseconds, a write lock is held before it lapses unless renewed **/
+#define DFS_WRITE_LEASE 10000
+
+/** The lease expiry timer wheel turns one slot every tick, in milliseconds **/
+#define DFS_LEASE_WHEEL_TICK 100
+#define DFS_LEASE_WHEEL_SLOTS 512
+
+/** Number of independently locked shards in the server's per-file state table **/
+#define DFS_FILE_TABLE_SHARDS 64
+
+/** The most files one AcquireWriteLocks call can lock, since it holds all their lease locks at once **/
+#define DFS_LOCK_BATCH_MAX 4096
+
+/** Default number of transfers a client sync runs at once **/
+#define DFS_TRANSFER_CONCURRENCY 4
+
+/** Number of per-file locks a client stripes its file names across **/
+#define DFS_CLIENT_FILE_LOCK_STRIPES 64
+
+/** Files at least this big, in bytes, sync in the client's large file lane **/
+#define DFS_LARGE_FILE_SIZE 67108864
+
+/** The percentage of a client's transfer workers the large file lane may have at once. It always gets one **/
+#define DFS_LARGE_FILE_SHARE 25
+
+/** How long, in milliseconds, a file the user stored, fetched or deleted keeps jumping the sync queue **/
+#define DFS_TOUCHED_WINDOW 600000
+
+/** Default burst, in bytes, a throttled client may send or receive at full speed before pacing kicks in **/
+#define DFS_THROTTLE_BURST 1048576
+
+/** Threads driving a client's Store and Fetch streams on its transfer completion queue **/
+#define DFS_TRANSFER_QUEUE_THREADS 2
+
+/** How often, in milliseconds, a client looks for a throttled transfer that has stopped moving **/
+#define DFS_TRANSFER_STALL_CHECK 250
+
+/** A fetch is written to "." + the file name + this suffix, then renamed into place **/
+#define DFS_FETCH_TEMP_SUFFIX ".dfs-fetch"
+
+/** A mounted client's sync state is kept in this hidden file in its mount **/
+#define DFS_SYNC_STATE_FILE ".dfs-sync-state"
+
+/** How often, in milliseconds, a mounted client saves its sync state if it has changed **/
+#define DFS_SYNC_STATE_INTERVAL 2000
+
+/** How often, in milliseconds, the server and a mounted client log their lock stats. 0 turns it off **/
+#define DFS_STATS_INTERVAL 60000
+
+/** How many of the most waited on locks of each kind the stats name **/
+#define DFS_STATS_TOP_CONTENDED 8
+
 extern const char* ClientIdMetadataKey;
 extern const char* FileNameMetadataKey;
 extern const char* CheckSumMetadataKey;
 extern const char* MtimeMetadataKey;
+/** Present on a WriteFile or DeleteFile that should take the write lock itself **/
+extern const char* AcquireLockMetadataKey;
+/** Initial metadata on such a WriteFile with the length of the lease taken, in milliseconds **/
+extern const char* LeaseMetadataKey;
+/** On a WriteFile or DeleteFile, the version the client expects to replace, 0 for none. Such a call needs no lock **/
+extern const char* ExpectedVersionMetadataKey;
+/** The server version of the file a response is about, in GetFile initial and failed write trailing metadata **/
+extern const char* VersionMetadataKey;
 
 extern int ChunkSize;
 
 int getStat(std::string path, dfs_service::FileStatus* fs);
 
+void fillFileStatus(const struct stat& result, dfs_service::FileStatus* fs);
+
+/**
+ * Add the stats of every lock class in this process
+ *
+ * @param stats
+ */
+void fillLockStats(dfs_service::Stats* stats);
+
+/**
+ * Render stats for the log, one lock class or counter per line, with wait and hold
+ * percentiles read off the histograms
+ *
+ * @param stats
+ * @return the text
+ */
+std::string formatStats(const dfs_service::Stats& stats);
+
+/**
+ * A token bucket refilled continuously at `rate` tokens a second, holding at most `burst`.
+ * Thread safe.
+ */
+class TokenBucket {
+
+public:
+    TokenBucket(double rate, double burst);
+
+    /**
+     * Take tokens if the bucket holds enough
+     *
+     * @param tokens
+     * @return bool, false if the caller should be turned away
+     */
+    bool TryTake(double tokens = 1);
+
+    /**
+     * Take tokens whether or not the bucket holds enough, running it into debt if need be.
+     * Callers that each wait out the debt they see are spaced evenly at the refill rate
+     *
+     * @param tokens
+     * @return how long until the bucket is out of debt, zero if it isn't in debt
+     */
+    std::chrono::duration<double> Reserve(double tokens);
+
+    /**
+     * Change the refill rate and size from now on. Growing the bucket adds the extra room to it
+     *
+     * @param rate
+     * @param burst
+     */
+    void Reset(double rate, double burst);
+
+private:
+    void Refill();
+
+    std::mutex mutex;
+    double rate;
+    double burst;
+    double tokens;
+    std::chrono::steady_clock::time_point refilled;
+};
+
+/**
+ * A rate that depends on the local time of day: a default, and windows with rates of their
+ * own. The first window holding the time wins, and a window may run past midnight. A rate
+ * of 0 is unlimited.
+ */
+class RateSchedule {
+
+public:
+    RateSchedule();
+
+    /**
+     * Parse a schedule of the form <rate>[,<HH:MM>-<HH:MM>=<rate>]..., e.g. "10m,09:00-17:30=512k".
+     * Rates are bytes a second, with an optional k, m or g suffix
+     *
+     * @param spec
+     * @param schedule
+     * @return false if the spec is malformed
+     */
+    static bool Parse(const std::string& spec, RateSchedule* schedule);
+
+    /**
+     * The rate in force at a time
+     *
+     * @param when
+     * @return bytes a second, 0 if unlimited
+     */
+    double RateAt(std::time_t when) const;
+
+    /** Whether every rate in the schedule is unlimited **/
+    bool Unlimited() const;
+
+private:
+    struct Window {
+        /** Minutes past midnight, the end excluded **/
+        int start;
+        int end;
+        double rate;
+    };
+
+    double default_rate;
+    std::vector<Window> windows;
+
+    static bool ParseRate(const std::string& text, double* rate);
+    static bool ParseTime(const std::string& text, int* minutes);
+};
+
+/**
+ * Paces a byte stream, or several sharing a link, to a RateSchedule. Bytes beyond the burst
+ * are spread out evenly rather than let through in bursts. Thread safe.
+ */
+class Throttle {
+
+public:
+    Throttle();
+
+    /**
+     * Set the schedule and burst. Not safe while the throttle is in use
+     *
+     * @param schedule
+     * @param burst bytes that may go at full speed after a lull
+     */
+    void Configure(const RateSchedule& schedule, double burst);
+
+    /**
+     * Account for bytes about to be sent or received
+     *
+     * @param bytes
+     * @return how long to wait before moving them, zero to go ahead now
+     */
+    std::chrono::duration<double> Delay(std::size_t bytes);
+
+    /** Whether the throttle never holds anything back **/
+    bool Unlimited() const;
+
+private:
+    RateSchedule schedule;
+    double burst;
+    TokenBucket bucket;
+
+    /** The rate last taken from the schedule, rechecked every second. Guarded by mutex **/
+    std::mutex mutex;
+    double rate;
+    std::chrono::steady_clock::time_point rate_checked;
+};
+
+/**
+ * A SubscriptionFilter compiled once so that testing a name doesn't re-parse the patterns.
+ * Exact names are hashed, trailing-'*' prefixes are compared directly and only patterns
+ * with other wildcards fall back to fnmatch.
+ */
+class FileNameMatcher {
+
+public:
+    explicit FileNameMatcher(const dfs_service::SubscriptionFilter& filter);
+
+    /**
+     * Whether the named file passes the filter
+     *
+     * @param name
+     * @return bool
+     */
+    bool Matches(const std::string& name) const;
+
+    /**
+     * A canonical string for the filter, equal for filters with the same patterns
+     *
+     * @param filter
+     * @return the key, empty for a filter that passes everything
+     */
+    static std::string Key(const dfs_service::SubscriptionFilter& filter);
+
+private:
+    struct Rules {
+        std::unordered_set<std::string> exact;
+        std::vector<std::string> prefixes;
+        std::vector<std::string> globs;
+
+        void Add(const std::string& pattern);
+        bool Empty() const;
+        bool Matches(const std::string& name) const;
+    };
+
+    Rules include;
+    Rules exclude;
+};
+
 inline std::string status_code_str(grpc::StatusCode code) {
     switch (code) {
         case grpc::StatusCode::OK: return "OK";
@@ -52,6 +52,10 @@ void DFSClient::ProcessCommand(const std::string &command, const std::string &fi
 
         client_node.Stat(filename);
 
+    } else if (command == "stats") {
+
+        client_node.ServerStats(true);
+
     } else {
 
         dfs_log(LL_ERROR) << "Unknown command";
@@ -74,6 +78,31 @@ void DFSClient::SetDeadlineTimeout(int deadline) {
     this->client_node.SetDeadlineTimeout(deadline);
 }
 
+void DFSClient::SetTransferConcurrency(int concurrency) {
+    this->client_node.SetTransferConcurrency(concurrency);
+}
+
+void DFSClient::SetLargeFileLane(std::uint64_t size, int share) {
+    this->client_node.SetLargeFileLane(size, share);
+}
+
+void DFSClient::SetThrottle(const RateSchedule& upload, const RateSchedule& download, double burst) {
+    this->client_node.SetThrottle(upload, download, burst);
+}
+
+void DFSClient::SetStatsInterval(int interval) {
+    this->stats_interval = interval;
+    this->client_node.SetStatsInterval(interval);
+}
+
+void DFSClient::SetSubscribe(bool subscribe) {
+    this->subscribe = subscribe;
+}
+
+void DFSClient::SetSubscriptionFilter(const std::vector<std::string>& include, const std::vector<std::string>& exclude) {
+    this->client_node.SetSubscriptionFilter(include, exclude);
+}
+
 void DFSClient::Mount(const std::string &filepath) {
 
     this->mount_path = filepath;
@@ -83,6 +112,11 @@ void DFSClient::Mount(const std::string &filepath) {
 
     dfs_log(LL_SYSINFO) << "Mounting on " << this->mount_path;
 
+    // Index the mount once up front; the watcher keeps it current from here on. Anything
+    // changed since the last mount goes to the server before the server's changes come in
+    this->client_node.SeedLocalIndex();
+    this->client_node.ReplayOfflineChanges();
+
     std::vector <std::thread> threads;
     //    uint event_flags = IN_CLOSE_WRITE | IN_OPEN;
     uint event_flags = IN_CREATE | IN_MODIFY | IN_DELETE;
@@ -101,11 +135,22 @@ void DFSClient::Mount(const std::string &filepath) {
     events.emplace_back(n_event);
     threads.push_back(std::move(thread_watcher));
 
-    thread_async = std::thread(&DFSClientNodeP2::HandleCallbackList, &this->client_node);
-    threads.push_back(std::move(thread_async));
+    if (this->subscribe) {
+        thread_async = std::thread(&DFSClientNodeP2::HandleSubscription, &this->client_node);
+        threads.push_back(std::move(thread_async));
+    } else {
+        thread_async = std::thread(&DFSClientNodeP2::HandleCallbackList, &this->client_node);
+        threads.push_back(std::move(thread_async));
+
+        // Initialize the callback list
+        this->client_node.InitCallbackList();
+    }
+
+    if (this->stats_interval > 0) {
+        threads.emplace_back(&DFSClientNodeP2::HandleStatsDump, &this->client_node);
+    }
 
-    // Initialize the callback list
-    this->client_node.InitCallbackList();
+    threads.emplace_back(&DFSClientNodeP2::HandleSyncStateSave, &this->client_node);
 
     for (std::thread &t : threads) {
         if (t.joinable()) { t.join(); }
@@ -115,6 +160,7 @@ void DFSClient::Mount(const std::string &filepath) {
 void DFSClient::Unmount() {
     std::vector <FileDescriptor> descriptors;
 
+    this->client_node.SaveSyncState();
     this->client_node.Unmount();
     for (NotifyStruct &e: events) {
         if (e.thread->joinable()) { e.thread->detach(); }
@@ -241,28 +287,59 @@ void Usage() {
         "-d, --debug_level <level>:  The debug level to use: 0, 1, 2, 3 (default: 0 = no debug, higher numbers increase verbosity)\n"
         "-m, --mount_path <path>:  The mount path this client attaches to\n"
         "-t, --deadline_timeout <int>:  The deadline timeout in milliseconds (default: 10000)\n"
+        "-s, --subscribe:          Follow the server's change event stream when mounted instead of polling the file listing\n"
+        "-i, --include <pattern>:  Only sync files matching the pattern (name, prefix* or glob). May be repeated\n"
+        "-x, --exclude <pattern>:  Don't sync files matching the pattern. May be repeated\n"
+        "-c, --concurrency <num>:  How many transfers a sync runs at once (default: 4)\n"
+        "-l, --large_file <bytes>:  Files at least this big sync in the large file lane (default: 67108864)\n"
+        "-b, --large_share <percent>:  The percentage of the transfers the large file lane may run at once (default: 25)\n"
+        "-U, --upload_limit <rate>:  Limit stores to bytes a second, with a k, m or g suffix, 0 for no limit. Time of day\n"
+        "                          windows may follow, e.g. 10m,09:00-17:30=512k (default: 0)\n"
+        "-D, --download_limit <rate>:  Limit fetches the same way (default: 0)\n"
+        "-B, --burst <bytes>:      How much a limited transfer may move at full speed after a lull (default: 1048576)\n"
+        "-p, --stats_interval <ms>:  How often a mounted client logs its lock contention stats, 0 to never (default: 60000)\n"
         "-h, --help:               Show help\n"
         "\n"
-        "COMMAND is one of mount|fetch|store|delete|list|stat.\n"
-        "FILENAME is the filename to fetch, store, delete, or stat. The mount and list commands do not require a filename.\n\n";
+        "COMMAND is one of mount|fetch|store|delete|list|stat|stats.\n"
+        "FILENAME is the filename to fetch, store, delete, or stat. The mount, list and stats commands do not require a filename.\n\n";
     exit(1);
 }
 
 int main(int argc, char** argv) {
 
-    const char* const short_opts = "a:d:m:r:t:h";
+    const char* const short_opts = "a:d:m:r:t:si:x:p:c:l:b:U:D:B:h";
 
     const option long_opts[] = {
         {"address", optional_argument, nullptr, 'a'},
         {"debug_level", optional_argument, nullptr, 'd'},
         {"mount_path", optional_argument, nullptr, 'm'},
         {"deadline_timeout", optional_argument, nullptr, 't'},
+        {"subscribe", no_argument, nullptr, 's'},
+        {"include", required_argument, nullptr, 'i'},
+        {"exclude", required_argument, nullptr, 'x'},
+        {"stats_interval", required_argument, nullptr, 'p'},
+        {"concurrency", required_argument, nullptr, 'c'},
+        {"large_file", required_argument, nullptr, 'l'},
+        {"large_share", required_argument, nullptr, 'b'},
+        {"upload_limit", required_argument, nullptr, 'U'},
+        {"download_limit", required_argument, nullptr, 'D'},
+        {"burst", required_argument, nullptr, 'B'},
         {"help", no_argument, nullptr, 'h'},
         {nullptr, no_argument, nullptr, 0}
     };
 
     char option_char;
     int deadline_timeout = 10000;
+    bool subscribe = false;
+    int stats_interval = DFS_STATS_INTERVAL;
+    int concurrency = DFS_TRANSFER_CONCURRENCY;
+    std::uint64_t large_file = DFS_LARGE_FILE_SIZE;
+    int large_share = DFS_LARGE_FILE_SHARE;
+    RateSchedule upload_limit;
+    RateSchedule download_limit;
+    double burst = DFS_THROTTLE_BURST;
+    std::vector<std::string> include;
+    std::vector<std::string> exclude;
     int debug_level = static_cast<int>(LL_ERROR);
     std::string command = "";
     std::string filename = "";
@@ -290,6 +367,42 @@ int main(int argc, char** argv) {
             case 't':
                 deadline_timeout = std::stoi(optarg);
                 break;
+            case 's':
+                subscribe = true;
+                break;
+            case 'i':
+                include.emplace_back(optarg);
+                break;
+            case 'x':
+                exclude.emplace_back(optarg);
+                break;
+            case 'p':
+                stats_interval = std::stoi(optarg);
+                break;
+            case 'c':
+                concurrency = std::stoi(optarg);
+                break;
+            case 'l':
+                large_file = std::stoull(optarg);
+                break;
+            case 'b':
+                large_share = std::stoi(optarg);
+                break;
+            case 'U':
+                if (!RateSchedule::Parse(optarg, &upload_limit)) {
+                    std::cerr << "\nBad upload limit: " << optarg << "\n";
+                    Usage();
+                }
+                break;
+            case 'D':
+                if (!RateSchedule::Parse(optarg, &download_limit)) {
+                    std::cerr << "\nBad download limit: " << optarg << "\n";
+                    Usage();
+                }
+                break;
+            case 'B':
+                burst = std::stod(optarg);
+                break;
             case 'h':
                 Usage();
                 break;
@@ -335,14 +448,14 @@ int main(int argc, char** argv) {
         return -1;
     }
 
-    std::string commands("fetch store delete list stat mount sync");
+    std::string commands("fetch store delete list stat stats mount sync");
     if (commands.find(command) == std::string::npos ) {
         std::cerr << "\nUnknown command!\n";
         Usage();
         return -1;
     }
 
-    std::string nonpath_commands("list mount sync");
+    std::string nonpath_commands("list stats mount sync");
     if (filename.empty() && nonpath_commands.find(command) == std::string::npos ) {
         std::cerr << "\nMissing filename!\n";
         Usage();
@@ -354,6 +467,12 @@ int main(int argc, char** argv) {
 
     client.SetMountPath(mount_path);
     client.SetDeadlineTimeout(deadline_timeout);
+    client.SetSubscribe(subscribe);
+    client.SetStatsInterval(stats_interval);
+    client.SetTransferConcurrency(concurrency);
+    client.SetLargeFileLane(large_file, large_share);
+    client.SetThrottle(upload_limit, download_limit, burst);
+    client.SetSubscriptionFilter(include, exclude);
     client.InitializeClientNode(server_address);
     client.ProcessCommand(command, filename);
 
@@ -30,6 +30,12 @@ class DFSClient {
         // The sync thread
         std::thread thread_async;
 
+        // Follow the server's Subscribe stream instead of the CallbackList loop
+        bool subscribe = false;
+
+        // How often a mounted client logs its lock stats, in milliseconds. 0 turns it off
+        int stats_interval = DFS_STATS_INTERVAL;
+
     public:
         DFSClient();
         ~DFSClient();
@@ -65,6 +71,52 @@ class DFSClient {
          */
         void SetDeadlineTimeout(int deadline);
 
+        /**
+         * Follow the server's change event stream when mounted rather than polling CallbackList
+         *
+         * @param subscribe
+         */
+        void SetSubscribe(bool subscribe);
+
+        /**
+         * How often a mounted client logs its lock stats, in milliseconds. 0 turns it off
+         *
+         * @param interval
+         */
+        void SetStatsInterval(int interval);
+
+        /**
+         * How many transfers a sync runs at once
+         *
+         * @param concurrency
+         */
+        void SetTransferConcurrency(int concurrency);
+
+        /**
+         * Which files sync in the large file lane, and the percentage of the transfer workers it gets
+         *
+         * @param size
+         * @param share
+         */
+        void SetLargeFileLane(std::uint64_t size, int share);
+
+        /**
+         * Limit how fast stores and fetches move file contents
+         *
+         * @param upload
+         * @param download
+         * @param burst bytes that may go at full speed after a lull
+         */
+        void SetThrottle(const RateSchedule& upload, const RateSchedule& download, double burst);
+
+        /**
+         * Only hear about changes to files matching the include patterns and none of the exclude patterns
+         *
+         * @param include
+         * @param exclude
+         */
+        void SetSubscriptionFilter(const std::vector<std::string>& include, const std::vector<std::string>& exclude);
+
         /**
          * Mounts the client to the specified file path.
          *
@@ -5,6 +5,7 @@
 #include <csignal>
 
 #include "dfs-utils.h"
+#include "../dfslib-shared-p2.h"
 #include "../dfslib-servernode-p2.h"
 
 void HandleSignal(int signum) {
@@ -18,19 +19,31 @@ void Usage() {
         "-d, --debug_level <level>:  The debug level to use: 0, 1, 2, 3 (default: 0 = no debug, higher numbers increase verbosity)\n"
         "-m, --mount_path <path>:       The mount storage path (default: mnt/server)\n"
         "-n, --num_async_threads <num>: The number of asynchronous threads to generate (default: 4)\n"
+        "-l, --callback_hold_timeout <ms>: The longest a callback list request is held waiting for a change (default: 30000)\n"
+        "-w, --coalesce_window <ms>:    How long a file must go unchanged before its change is published, 0 to publish at once (default: 200)\n"
+        "-r, --resync_rate <num>:       Full resyncs admitted per second after the burst is spent (default: 5)\n"
+        "-b, --resync_burst <num>:      Full resyncs admitted at once, e.g. right after a restart (default: 10)\n"
+        "-e, --write_lease <ms>:        How long a write lock is held unless the client renews it (default: 10000)\n"
+        "-t, --stats_interval <ms>:     How often lock contention and queue stats are logged, 0 to never (default: 60000)\n"
         "-h, --help:                    Show help\n\n";
     exit(1);
 }
 
 int main(int argc, char** argv) {
 
-    const char* const short_opts = "a:d:m:h";
+    const char* const short_opts = "a:d:m:l:w:r:b:e:t:h";
 
     const option long_opts[] = {
         {"address", optional_argument, nullptr, 'a'},
         {"debug_level", optional_argument, nullptr, 'd'},
         {"mount_path", optional_argument, nullptr, 'm'},
         {"num_async_threads", optional_argument, nullptr, 'n'},
+        {"callback_hold_timeout", optional_argument, nullptr, 'l'},
+        {"coalesce_window", optional_argument, nullptr, 'w'},
+        {"resync_rate", optional_argument, nullptr, 'r'},
+        {"resync_burst", optional_argument, nullptr, 'b'},
+        {"write_lease", optional_argument, nullptr, 'e'},
+        {"stats_interval", optional_argument, nullptr, 't'},
         {"help", no_argument, nullptr, 'h'},
         {nullptr, no_argument, nullptr, 0}
     };
@@ -38,6 +51,12 @@ int main(int argc, char** argv) {
     char option_char;
     int debug_level = static_cast<int>(LL_ERROR);
     long num_async_threads = 4;
+    int callback_hold_timeout = DFS_CALLBACK_HOLD_TIMEOUT;
+    int coalesce_window = DFS_COALESCE_WINDOW;
+    double resync_rate = DFS_RESYNC_RATE;
+    int resync_burst = DFS_RESYNC_BURST;
+    int write_lease = DFS_WRITE_LEASE;
+    int stats_interval = DFS_STATS_INTERVAL;
     std::string mount_path = "mnt/server/";
     std::string server_address = "0.0.0.0:42001";
 
@@ -55,6 +74,24 @@ int main(int argc, char** argv) {
             case 'n':
                 num_async_threads = std::stoi(optarg);
                 break;
+            case 'l':
+                callback_hold_timeout = std::stoi(optarg);
+                break;
+            case 'w':
+                coalesce_window = std::stoi(optarg);
+                break;
+            case 'r':
+                resync_rate = std::stod(optarg);
+                break;
+            case 'b':
+                resync_burst = std::stoi(optarg);
+                break;
+            case 'e':
+                write_lease = std::stoi(optarg);
+                break;
+            case 't':
+                stats_interval = std::stoi(optarg);
+                break;
             case 'h':
             case '?':
             default:
@@ -71,6 +108,11 @@ int main(int argc, char** argv) {
     signal(SIGTERM, HandleSignal);
 
     DFSServerNode server_node(server_address, dfs_clean_path(mount_path), num_async_threads, [&]{ return; });
+    server_node.SetCallbackHoldTimeout(callback_hold_timeout);
+    server_node.SetCoalesceWindow(coalesce_window);
+    server_node.SetResyncLimit(resync_rate, resync_burst);
+    server_node.SetWriteLease(write_lease);
+    server_node.SetStatsInterval(stats_interval);
     server_node.Start();
 
     return 0;
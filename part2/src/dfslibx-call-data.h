@@ -3,8 +3,15 @@
 
 #include <grpcpp/grpcpp.h>
 #include "dfs-utils.h"
+#include "dfslibx-object-pool.h"
 #include "../proto-src/dfs-service.grpc.pb.h"
 
+/** How many calls per request/response type are served from pooled storage before falling back to the heap **/
+#define DFS_CALL_DATA_POOL_SIZE 1024
+
+template <typename RequestT, typename ResponseT>
+class DFSCallData;
+
 /**
  * Virtual class meant to be inherited by the DFSServiceImpl class. It is used
  * solely to abstract certain callback features and make them available in the
@@ -22,7 +29,12 @@ public:
                                  grpc::ServerAsyncResponseWriter<ResponseT>* responder,
                                  grpc::ServerCompletionQueue* cq,
                                  void* tag) {}
-    virtual void ProcessCallback(grpc::ServerContext* context, RequestT* request, ResponseT* response) {}
+    /**
+     * Process a callback request. Returning false parks the call: the manager keeps
+     * the call pointer and answers it later through DFSCallData::Complete.
+     */
+    virtual bool ProcessCallback(grpc::ServerContext* context, RequestT* request, ResponseT* response,
+                                 DFSCallData<RequestT, ResponseT>* call) { return true; }
 
 };
 
@@ -67,7 +79,26 @@ private:
     enum CallStatus { CREATE, PROCESS, FINISH };
     CallStatus status;  // The current serving state.
 
+    using Pool = DFSObjectPool<DFSCallData<RequestT, ResponseT>, DFS_CALL_DATA_POOL_SIZE>;
+
 public:
+
+    /**
+     * The storage every call of this type is constructed in
+     */
+    static Pool& CallPool() {
+        static Pool pool;
+        return pool;
+    }
+
+    /**
+     * Start a new call waiting for the next request, in pooled storage
+     */
+    static DFSCallData<RequestT, ResponseT>* Spawn(dfs_service::DFSService::AsyncService* service,
+        DFSCallDataManager<RequestT, ResponseT>* manager, grpc::ServerCompletionQueue* cq) {
+        return CallPool().Acquire(service, manager, cq);
+    }
+
     // Take in the "service" instance (in this case representing an asynchronous
     // server) and the completion queue "cq" used for asynchronous communication
     // with the gRPC runtime.
@@ -103,25 +134,56 @@ public:
             // Spawn a new CallData instance to serve new clients while we process
             // the one for this CallData. The instance will deallocate itself as
             // part of its FINISH state.
-            new DFSCallData<RequestT, ResponseT>(service, manager, cq);
-
-            manager->ProcessCallback(&ctx_, &request_, &reply_);
+            Spawn(service, manager, cq);
 
-            // And we are done! Let the gRPC runtime know we've finished, using the
-            // memory address of this instance as the uniquely identifying tag for
-            // the event.
+            // The manager may park the call and complete it from another thread
+            // before ProcessCallback returns, so move to FINISH first.
             status = FINISH;
-            responder.Finish(reply_, grpc::Status::OK, this);
+            if (manager->ProcessCallback(&ctx_, &request_, &reply_, this)) {
+                // And we are done! Let the gRPC runtime know we've finished, using the
+                // memory address of this instance as the uniquely identifying tag for
+                // the event.
+                Complete();
+            }
         } else {
             dfs_log(LL_DEBUG3) << "Proceed[Finish]";
             // GPR_ASSERT(status == FINISH);
             if (status != FINISH) {
                 dfs_log(LL_ERROR) << "HandleAsyncRPC finish status was not correct.";
             }
-            // Once in the FINISH state, deallocate ourselves (CallData).
-            delete this;
+            // Once in the FINISH state, hand our storage back to the pool.
+            CallPool().Release(this);
         }
     }
+
+    /**
+     * Give up on a call whose completion queue event came back not ok, e.g. because the
+     * client went away before the reply was sent or the server is shutting down
+     */
+    void Abandon() {
+        dfs_log(LL_DEBUG3) << "Abandon";
+        CallPool().Release(this);
+    }
+
+    /**
+     * Send the reply for a call, either right away or after it was parked by the manager
+     */
+    void Complete() {
+        responder.Finish(reply_, grpc::Status::OK, this);
+    }
+
+    /**
+     * Turn a call away with an error instead of a reply
+     */
+    void Fail(const grpc::Status& error) {
+        responder.FinishWithError(error, this);
+    }
+
+    grpc::ServerContext* Context() { return &ctx_; }
+
+    RequestT* Request() { return &request_; }
+
+    ResponseT* Reply() { return &reply_; }
 };
 
 #endif //PR4_DFSCALLDATAMANAGER_H
@@ -9,8 +9,12 @@
 #include <mutex>
 
 #include <grpcpp/grpcpp.h>
+#include "dfslibx-object-pool.h"
 #include "../proto-src/dfs-service.grpc.pb.h"
 
+/** How many async calls are served from pooled storage before falling back to the heap **/
+#define DFS_CLIENT_CALL_POOL_SIZE 8
+
 /**
  * The containing structure used to pass async data
  */
@@ -30,6 +34,15 @@ struct AsyncClientData {
     // Client Responder based off of the response message type
     std::unique_ptr<grpc::ClientAsyncResponseReader<ResponseT>> response_reader;
 
+    using Pool = DFSObjectPool<AsyncClientData<ResponseT>, DFS_CLIENT_CALL_POOL_SIZE>;
+
+    // The storage every call for this response type is constructed in. Calls are
+    // acquired in CallbackList and must be handed back with Release
+    static Pool& CallPool() {
+        static Pool pool;
+        return pool;
+    }
+
 };
 
 class DFSClientNode {
@@ -193,14 +206,10 @@ public:
      * Student's should not have to adjust this method
      */
     template<typename RequestT, typename ResponseT>
-    void CallbackList() {
-
-        // Data we are sending to the server.
-        RequestT request;
-        request.set_name("");
+    void CallbackList(const RequestT& request) {
 
         // Call object to store rpc data
-        AsyncClientData<ResponseT>* call_data = new AsyncClientData<ResponseT>;
+        AsyncClientData<ResponseT>* call_data = AsyncClientData<ResponseT>::CallPool().Acquire();
 
         // stub_->PrepareAyncCallbackList() creates an RPC object, returning
         // an instance to store in "call_data" but does not actually start the RPC.
@@ -0,0 +1,331 @@
+#ifndef PR4_DFSLIBX_LOCK_STATS_H
+#define PR4_DFSLIBX_LOCK_STATS_H
+
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+#include <shared_mutex>
+#include <unordered_map>
+
+/**
+ * Acquisition counts and wait/hold time histograms shared by every lock of one kind, e.g.
+ * every per-file lock on the server.
+ *
+ * The counters are striped across cache lines by thread, so that locks which never contend
+ * with each other don't start contending on their statistics. Times are kept in power of two
+ * microsecond buckets: bucket 0 counts times under 1us, and bucket i times in [2^(i-1), 2^i) us,
+ * with the last bucket taking everything longer.
+ *
+ * Contended acquisitions are also tallied by the label of the lock that was waited on, so the
+ * hottest files can be picked out. That tally is only touched when a thread actually had to
+ * wait, and keeps at most LabelLimit labels, dropping the least waited on.
+ */
+class DFSLockClass {
+
+public:
+
+    static constexpr std::size_t Buckets = 24;
+    static constexpr std::size_t LabelLimit = 1024;
+
+    /** How much waiting one labelled lock has caused **/
+    struct Contention {
+        std::string label;
+        std::uint64_t contended;
+        std::uint64_t wait_ns;
+    };
+
+    /** A point in time copy of the counters **/
+    struct Snapshot {
+        std::string name;
+        std::uint64_t acquisitions = 0;
+        std::uint64_t contended = 0;
+        std::uint64_t wait_ns = 0;
+        std::uint64_t hold_ns = 0;
+        std::uint64_t wait_histogram[Buckets] = {};
+        std::uint64_t hold_histogram[Buckets] = {};
+        std::vector<Contention> top_contended;
+    };
+
+private:
+
+    static constexpr std::size_t Stripes = 16;
+
+    struct alignas(64) Stripe {
+        std::atomic<std::uint64_t> acquisitions{0};
+        std::atomic<std::uint64_t> contended{0};
+        std::atomic<std::uint64_t> wait_ns{0};
+        std::atomic<std::uint64_t> hold_ns{0};
+        std::atomic<std::uint64_t> wait_histogram[Buckets];
+        std::atomic<std::uint64_t> hold_histogram[Buckets];
+
+        Stripe() {
+            for (std::size_t i = 0; i < Buckets; i++) {
+                wait_histogram[i] = 0;
+                hold_histogram[i] = 0;
+            }
+        }
+    };
+
+    std::string name;
+
+    std::unique_ptr<Stripe[]> stripes;
+
+    /** Guards contention **/
+    std::mutex contention_mutex;
+    std::unordered_map<std::string, Contention> contention;
+
+    Stripe& ThreadStripe() {
+        static std::atomic<std::size_t> next_thread(0);
+        thread_local std::size_t index = next_thread++ % Stripes;
+        return stripes[index];
+    }
+
+    static std::size_t Bucket(std::uint64_t ns) {
+        std::uint64_t us = ns / 1000;
+        std::size_t bucket = 0;
+        while (us != 0 && bucket < Buckets - 1) {
+            us >>= 1;
+            bucket++;
+        }
+        return bucket;
+    }
+
+    void RecordContention(const std::string& label, std::uint64_t wait_ns) {
+        if (label.empty()) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(contention_mutex);
+        auto found = contention.find(label);
+        if (found == contention.end()) {
+            if (contention.size() >= LabelLimit) {
+                auto least = std::min_element(contention.begin(), contention.end(),
+                    [](const std::pair<const std::string, Contention>& a, const std::pair<const std::string, Contention>& b) {
+                        return a.second.wait_ns < b.second.wait_ns;
+                    });
+                contention.erase(least);
+            }
+            found = contention.emplace(label, Contention{label, 0, 0}).first;
+        }
+        found->second.contended++;
+        found->second.wait_ns += wait_ns;
+    }
+
+public:
+
+    explicit DFSLockClass(const std::string& name) : name(name), stripes(new Stripe[Stripes]) {}
+
+    DFSLockClass(const DFSLockClass&) = delete;
+    DFSLockClass& operator=(const DFSLockClass&) = delete;
+
+    const std::string& Name() const { return name; }
+
+    /**
+     * Count an acquisition
+     *
+     * @param wait_ns how long the caller waited, 0 if the lock was free
+     * @param label the lock's label, for the contention tally
+     */
+    void RecordAcquire(std::uint64_t wait_ns, const std::string& label) {
+        Stripe& stripe = ThreadStripe();
+        stripe.acquisitions.fetch_add(1, std::memory_order_relaxed);
+        stripe.wait_histogram[Bucket(wait_ns)].fetch_add(1, std::memory_order_relaxed);
+        if (wait_ns != 0) {
+            stripe.contended.fetch_add(1, std::memory_order_relaxed);
+            stripe.wait_ns.fetch_add(wait_ns, std::memory_order_relaxed);
+            RecordContention(label, wait_ns);
+        }
+    }
+
+    /**
+     * Count how long an exclusive acquisition was held
+     *
+     * @param hold_ns
+     */
+    void RecordHold(std::uint64_t hold_ns) {
+        Stripe& stripe = ThreadStripe();
+        stripe.hold_ns.fetch_add(hold_ns, std::memory_order_relaxed);
+        stripe.hold_histogram[Bucket(hold_ns)].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    /**
+     * Copy out the counters
+     *
+     * @param top how many of the most waited on labels to include
+     * @return the snapshot
+     */
+    Snapshot Take(std::size_t top) {
+        Snapshot snapshot;
+        snapshot.name = name;
+        for (std::size_t s = 0; s < Stripes; s++) {
+            Stripe& stripe = stripes[s];
+            snapshot.acquisitions += stripe.acquisitions.load(std::memory_order_relaxed);
+            snapshot.contended += stripe.contended.load(std::memory_order_relaxed);
+            snapshot.wait_ns += stripe.wait_ns.load(std::memory_order_relaxed);
+            snapshot.hold_ns += stripe.hold_ns.load(std::memory_order_relaxed);
+            for (std::size_t i = 0; i < Buckets; i++) {
+                snapshot.wait_histogram[i] += stripe.wait_histogram[i].load(std::memory_order_relaxed);
+                snapshot.hold_histogram[i] += stripe.hold_histogram[i].load(std::memory_order_relaxed);
+            }
+        }
+        {
+            std::lock_guard<std::mutex> lock(contention_mutex);
+            for (const auto& entry : contention) {
+                snapshot.top_contended.push_back(entry.second);
+            }
+        }
+        auto cut = snapshot.top_contended.begin() + std::min(top, snapshot.top_contended.size());
+        std::partial_sort(snapshot.top_contended.begin(), cut, snapshot.top_contended.end(),
+            [](const Contention& a, const Contention& b) { return a.wait_ns > b.wait_ns; });
+        snapshot.top_contended.erase(cut, snapshot.top_contended.end());
+        return snapshot;
+    }
+
+    /**
+     * The lock class with the given name, created on first use. Look it up once and keep the
+     * reference, since the lookup itself takes a process wide lock
+     *
+     * @param name
+     * @return the lock class
+     */
+    static DFSLockClass& Named(const std::string& name) {
+        std::lock_guard<std::mutex> lock(RegistryMutex());
+        std::unique_ptr<DFSLockClass>& lock_class = Registry()[name];
+        if (!lock_class) {
+            lock_class.reset(new DFSLockClass(name));
+        }
+        return *lock_class;
+    }
+
+    /**
+     * Snapshots of every lock class in the process, in name order
+     *
+     * @param top how many of the most waited on labels to include for each
+     * @return the snapshots
+     */
+    static std::vector<Snapshot> TakeAll(std::size_t top) {
+        std::vector<DFSLockClass*> classes;
+        {
+            std::lock_guard<std::mutex> lock(RegistryMutex());
+            for (auto& entry : Registry()) {
+                classes.push_back(entry.second.get());
+            }
+        }
+        std::vector<Snapshot> snapshots;
+        for (DFSLockClass* lock_class : classes) {
+            snapshots.push_back(lock_class->Take(top));
+        }
+        return snapshots;
+    }
+
+private:
+
+    static std::mutex& RegistryMutex() {
+        static std::mutex mutex;
+        return mutex;
+    }
+
+    static std::map<std::string, std::unique_ptr<DFSLockClass>>& Registry() {
+        static std::map<std::string, std::unique_ptr<DFSLockClass>> registry;
+        return registry;
+    }
+};
+
+/**
+ * A drop-in wrapper for std::mutex or std::shared_timed_mutex that reports to a DFSLockClass.
+ *
+ * Every acquisition is counted and its wait timed, taking the uncontended path with a single
+ * try_lock. Exclusive holds are timed too; shared holds can overlap, so only their waits are.
+ * Use it with std::condition_variable_any in place of std::condition_variable.
+ *
+ * @tparam Mutex
+ */
+template <typename Mutex>
+class DFSInstrumentedMutex {
+
+private:
+
+    Mutex mutex;
+
+    DFSLockClass* lock_class;
+
+    /** Names this lock in the contention tally. Left empty for locks of which there is only one **/
+    std::string label;
+
+    /** When the current exclusive hold started. Only touched by the holder **/
+    std::chrono::steady_clock::time_point acquired_at;
+
+    template <typename Acquire>
+    void Timed(bool acquired, Acquire acquire) {
+        if (acquired) {
+            lock_class->RecordAcquire(0, label);
+            return;
+        }
+        auto start = std::chrono::steady_clock::now();
+        acquire();
+        auto waited = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        // A wait so short the clock didn't move still counts as contended
+        lock_class->RecordAcquire(std::max<std::int64_t>(waited, 1), label);
+    }
+
+public:
+
+    DFSInstrumentedMutex() : lock_class(&DFSLockClass::Named("unclassified")) {}
+
+    explicit DFSInstrumentedMutex(DFSLockClass& lock_class, const std::string& label = "") :
+        lock_class(&lock_class), label(label) {}
+
+    DFSInstrumentedMutex(const DFSInstrumentedMutex&) = delete;
+    DFSInstrumentedMutex& operator=(const DFSInstrumentedMutex&) = delete;
+
+    /** Report to another lock class. Only safe before the lock is first used **/
+    void SetLockClass(DFSLockClass& lock_class) { this->lock_class = &lock_class; }
+
+    /** Name this lock in the contention tally, e.g. one of an array. Only safe before the lock is first used **/
+    void SetLabel(const std::string& label) { this->label = label; }
+
+    void lock() {
+        Timed(mutex.try_lock(), [this]{ mutex.lock(); });
+        acquired_at = std::chrono::steady_clock::now();
+    }
+
+    bool try_lock() {
+        if (!mutex.try_lock()) {
+            return false;
+        }
+        lock_class->RecordAcquire(0, label);
+        acquired_at = std::chrono::steady_clock::now();
+        return true;
+    }
+
+    void unlock() {
+        auto held = std::chrono::steady_clock::now() - acquired_at;
+        mutex.unlock();
+        lock_class->RecordHold(std::chrono::duration_cast<std::chrono::nanoseconds>(held).count());
+    }
+
+    void lock_shared() {
+        Timed(mutex.try_lock_shared(), [this]{ mutex.lock_shared(); });
+    }
+
+    bool try_lock_shared() {
+        if (!mutex.try_lock_shared()) {
+            return false;
+        }
+        lock_class->RecordAcquire(0, label);
+        return true;
+    }
+
+    void unlock_shared() { mutex.unlock_shared(); }
+};
+
+using DFSMutex = DFSInstrumentedMutex<std::mutex>;
+using DFSSharedMutex = DFSInstrumentedMutex<std::shared_timed_mutex>;
+
+#endif //PR4_DFSLIBX_LOCK_STATS_H
@@ -0,0 +1,112 @@
+#ifndef PR4_DFSLIBX_OBJECT_POOL_H
+#define PR4_DFSLIBX_OBJECT_POOL_H
+
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <cstdint>
+#include <utility>
+#include <type_traits>
+
+/**
+ * A fixed-capacity pool of slots for objects of type T.
+ *
+ * The slots are allocated once, when the pool is created. Acquire constructs an object
+ * in a free slot and Release destroys it and hands the slot back, so a steady stream of
+ * short-lived objects never reaches the allocator. Objects are reset by destroying and
+ * reconstructing them in place, since gRPC contexts can't be reused across calls.
+ *
+ * If every slot is in use, Acquire falls back to the heap rather than failing, and the
+ * counters record that it did.
+ *
+ * @tparam T
+ * @tparam Capacity
+ */
+template <typename T, std::size_t Capacity>
+class DFSObjectPool {
+
+private:
+
+    using Slot = typename std::aligned_storage<sizeof(T), alignof(T)>::type;
+
+    // The slot storage, allocated once for the lifetime of the pool
+    std::unique_ptr<Slot[]> slots;
+
+    // Slots not holding an object, used as a stack so recently used slots are reused first
+    std::vector<Slot*> free_slots;
+
+    std::mutex mutex;
+
+    // Objects handed out in total, how many of those came from the heap, and how many
+    // are out right now
+    std::atomic<std::uint64_t> acquired;
+    std::atomic<std::uint64_t> heap_allocations;
+    std::atomic<std::uint64_t> in_use;
+
+    bool Owns(const T* object) const {
+        const Slot* slot = reinterpret_cast<const Slot*>(object);
+        return slot >= slots.get() && slot < slots.get() + Capacity;
+    }
+
+public:
+
+    DFSObjectPool() : slots(new Slot[Capacity]), acquired(0), heap_allocations(0), in_use(0) {
+        free_slots.reserve(Capacity);
+        for (std::size_t i = Capacity; i > 0; i--) {
+            free_slots.push_back(&slots[i - 1]);
+        }
+    }
+
+    DFSObjectPool(const DFSObjectPool&) = delete;
+    DFSObjectPool& operator=(const DFSObjectPool&) = delete;
+
+    /**
+     * Construct an object in a free slot, or on the heap if the pool is exhausted
+     *
+     * @param args the constructor arguments
+     * @return the object, to be handed back through Release
+     */
+    template <typename... Args>
+    T* Acquire(Args&&... args) {
+        Slot* slot = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!free_slots.empty()) {
+                slot = free_slots.back();
+                free_slots.pop_back();
+            }
+        }
+        acquired++;
+        in_use++;
+        if (slot == nullptr) {
+            heap_allocations++;
+            return new T(std::forward<Args>(args)...);
+        }
+        return new (slot) T(std::forward<Args>(args)...);
+    }
+
+    /**
+     * Destroy an object from Acquire and return its slot to the pool
+     *
+     * @param object
+     */
+    void Release(T* object) {
+        in_use--;
+        if (!Owns(object)) {
+            delete object;
+            return;
+        }
+        object->~T();
+        std::lock_guard<std::mutex> lock(mutex);
+        free_slots.push_back(reinterpret_cast<Slot*>(object));
+    }
+
+    std::uint64_t Acquired() const { return acquired; }
+
+    std::uint64_t HeapAllocations() const { return heap_allocations; }
+
+    std::uint64_t InUse() const { return in_use; }
+};
+
+#endif //PR4_DFSLIBX_OBJECT_POOL_H
@@ -37,12 +37,14 @@ struct QueueRequest {
     grpc::ServerCompletionQueue* cq;
     void* tag;
     bool finished;
+    std::chrono::steady_clock::time_point queued_at;
     QueueRequest(grpc::ServerContext* context,
                  RequestT* request,
                  grpc::ServerAsyncResponseWriter<ResponseT>* response,
                  grpc::ServerCompletionQueue* cq,
                  void* tag) :
-        context(context), request(request), response(response), cq(cq), tag(tag), finished(false) {}
+        context(context), request(request), response(response), cq(cq), tag(tag), finished(false),
+        queued_at(std::chrono::steady_clock::now()) {}
 };
 
 /**
@@ -60,7 +62,7 @@ static void HandleAsyncRPC(dfs_service::DFSService::AsyncService* service,
                            std::shared_ptr<grpc::ServerCompletionQueue> cq) {
 
     // Spawn a new CallData instance to serve new clients.
-    new DFSCallData<RequestT, ResponseT>(service, manager, cq.get());
+    DFSCallData<RequestT, ResponseT>::Spawn(service, manager, cq.get());
 
     void* tag;  // uniquely identifies a request.
 
@@ -76,8 +78,14 @@ static void HandleAsyncRPC(dfs_service::DFSService::AsyncService* service,
         // GPR_ASSERT(cq->Next(&tag, &ok));
         // GPR_ASSERT(ok);
         dfs_log(LL_DEBUG3) << "HandleAsyncRPC[Next]";
-        if (!cq->Next(&tag, &ok) || !ok) {
+        if (!cq->Next(&tag, &ok)) {
+            dfs_log(LL_ERROR) << "HandleAsyncRPC completion queue is shutting down";
+            break;
+        }
+        if (!ok) {
             dfs_log(LL_ERROR) << "HandleAsyncRPC failed to get an ok from completion queue. Did the client crash?";
+            // The call is over either way, so don't let its storage leak
+            static_cast<DFSCallData<RequestT, ResponseT>*>(tag)->Abandon();
             continue;
         }
         static_cast<DFSCallData<RequestT, ResponseT>*>(tag)->Proceed();
@@ -0,0 +1,189 @@
+#ifndef PR4_DFSLIBX_SHARDED_TABLE_H
+#define PR4_DFSLIBX_SHARDED_TABLE_H
+
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <cstddef>
+#include <functional>
+#include <shared_mutex>
+#include <unordered_map>
+
+#include "dfslibx-lock-stats.h"
+
+/**
+ * A table of per-key state, hash-partitioned into Shards independently locked shards.
+ *
+ * Lookups of different keys only contend when the keys hash to the same shard, and a
+ * lookup of an existing key only takes its shard's lock shared, so the common path never
+ * serializes with other readers.
+ *
+ * Lookups hand out reference counted handles. When the last handle to an entry is dropped
+ * and the value reports Idle(), the entry is removed, so the table only holds the keys that
+ * are in use or have state worth keeping. Idle() is called with the shard locked and must
+ * not look anything up in the table.
+ *
+ * The shard locks report to the lock class the table is constructed with.
+ *
+ * @tparam Value constructible from its key, with a bool Idle()
+ * @tparam Shards
+ */
+template <typename Value, std::size_t Shards>
+class DFSShardedTable {
+
+private:
+
+    struct Entry {
+        std::unique_ptr<Value> value;
+        std::atomic<std::size_t> refs;
+        explicit Entry(const std::string& key) : value(new Value(key)), refs(0) {}
+    };
+
+    // Each shard on its own cache line, so that locking one doesn't bounce its neighbours
+    struct alignas(64) Shard {
+        mutable DFSSharedMutex mutex;
+        std::unordered_map<std::string, Entry> entries;
+    };
+
+    std::unique_ptr<Shard[]> shards;
+
+    std::atomic<std::size_t> size;
+
+    Shard& ShardFor(const std::string& key) const {
+        return shards[std::hash<std::string>()(key) % Shards];
+    }
+
+    void Release(const std::string& key, Entry* entry) {
+        Shard& shard = ShardFor(key);
+        {
+            std::shared_lock<DFSSharedMutex> lock(shard.mutex);
+            if (entry->refs.fetch_sub(1) != 1) {
+                return;
+            }
+        }
+        std::unique_lock<DFSSharedMutex> lock(shard.mutex);
+        // Between the two locks someone may have picked the entry up again, or picked it up,
+        // dropped it and erased it already, so only the entry still in the table is looked at.
+        // If the key was re-inserted since, this one is gone and must not be touched
+        auto found = shard.entries.find(key);
+        if (found == shard.entries.end() || &found->second != entry) {
+            return;
+        }
+        if (found->second.refs == 0 && found->second.value->Idle()) {
+            shard.entries.erase(found);
+            size--;
+        }
+    }
+
+public:
+
+    /**
+     * A reference to an entry, which keeps it in the table for as long as the handle lives
+     */
+    class Handle {
+
+    private:
+
+        DFSShardedTable* table;
+        std::string key;
+        Entry* entry;
+
+        friend class DFSShardedTable;
+
+        Handle(DFSShardedTable* table, const std::string& key, Entry* entry) :
+            table(table), key(key), entry(entry) {}
+
+    public:
+
+        Handle() : table(nullptr), entry(nullptr) {}
+
+        Handle(Handle&& other) noexcept : table(other.table), key(std::move(other.key)), entry(other.entry) {
+            other.entry = nullptr;
+        }
+
+        Handle& operator=(Handle&& other) noexcept {
+            if (this != &other) {
+                Reset();
+                table = other.table;
+                key = std::move(other.key);
+                entry = other.entry;
+                other.entry = nullptr;
+            }
+            return *this;
+        }
+
+        Handle(const Handle&) = delete;
+        Handle& operator=(const Handle&) = delete;
+
+        ~Handle() { Reset(); }
+
+        /** Drop the reference early **/
+        void Reset() {
+            if (entry != nullptr) {
+                table->Release(key, entry);
+                entry = nullptr;
+            }
+        }
+
+        Value* get() const { return entry == nullptr ? nullptr : entry->value.get(); }
+
+        Value* operator->() const { return get(); }
+
+        explicit operator bool() const { return entry != nullptr; }
+    };
+
+    explicit DFSShardedTable(DFSLockClass& lock_class) : shards(new Shard[Shards]), size(0) {
+        for (std::size_t i = 0; i < Shards; i++) {
+            shards[i].mutex.SetLockClass(lock_class);
+        }
+    }
+
+    DFSShardedTable(const DFSShardedTable&) = delete;
+    DFSShardedTable& operator=(const DFSShardedTable&) = delete;
+
+    /**
+     * Look up the state for a key
+     *
+     * @param key
+     * @return a handle to the state, empty if the key has none
+     */
+    Handle Find(const std::string& key) {
+        Shard& shard = ShardFor(key);
+        std::shared_lock<DFSSharedMutex> lock(shard.mutex);
+        auto entry = shard.entries.find(key);
+        if (entry == shard.entries.end()) {
+            return Handle();
+        }
+        entry->second.refs++;
+        return Handle(this, key, &entry->second);
+    }
+
+    /**
+     * Look up the state for a key, constructing it from the key if the key has none
+     *
+     * @param key
+     * @return a handle to the state
+     */
+    Handle FindOrInsert(const std::string& key) {
+        Handle handle = Find(key);
+        if (handle) {
+            return handle;
+        }
+        Shard& shard = ShardFor(key);
+        std::unique_lock<DFSSharedMutex> lock(shard.mutex);
+        // Another thread may have inserted it between the two locks
+        auto inserted = shard.entries.emplace(std::piecewise_construct,
+            std::forward_as_tuple(key), std::forward_as_tuple(key));
+        if (inserted.second) {
+            size++;
+        }
+        inserted.first->second.refs++;
+        return Handle(this, key, &inserted.first->second);
+    }
+
+    /** The number of keys with state in the table **/
+    std::size_t Size() const { return size; }
+};
+
+#endif //PR4_DFSLIBX_SHARDED_TABLE_H
@@ -0,0 +1,178 @@
+#ifndef PR4_DFSLIBX_TRANSFER_POOL_H
+#define PR4_DFSLIBX_TRANSFER_POOL_H
+
+#include <map>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+#include <functional>
+#include <utility>
+#include <unordered_map>
+#include <condition_variable>
+
+#include "dfslibx-lock-stats.h"
+
+/**
+ * A fixed set of worker threads running tasks keyed by file name.
+ *
+ * Tasks with different keys run concurrently, up to the number of workers. Tasks with the
+ * same key run one at a time in the order they were submitted, so two transfers of one file
+ * can never overlap or overtake each other.
+ *
+ * Among tasks free to run, the lowest priority value goes first, and equal priorities go in
+ * submission order. Bulk tasks, e.g. transfers of very large files, have a lane of their own:
+ * at most a fixed number of workers run them at once, and a worker that frees up takes a bulk
+ * task first whenever the lane has room, so they neither hog the pool nor wait behind all of
+ * the rest.
+ */
+class DFSTransferPool {
+
+private:
+
+    struct Task {
+        std::string key;
+        std::function<void()> run;
+        std::uint64_t priority;
+        bool bulk;
+    };
+
+    /** Orders ready tasks by priority, then by when they were submitted **/
+    using Rank = std::pair<std::uint64_t, std::uint64_t>;
+
+    /** Tasks whose key is free, in the order they should run **/
+    std::map<Rank, Task> ready;
+    std::map<Rank, Task> ready_bulk;
+
+    /** Numbers the tasks in submission order **/
+    std::uint64_t submitted;
+
+    std::size_t bulk_limit;
+    std::size_t bulk_running;
+
+    /** Keys with a task queued or running, and the tasks waiting behind it **/
+    std::unordered_map<std::string, std::deque<Task>> busy;
+
+    /** Tasks submitted and not yet finished **/
+    std::size_t outstanding;
+
+    bool stopping;
+
+    DFSMutex mutex{DFSLockClass::Named("transfer_pool")};
+
+    /** Signalled when a task becomes ready, the bulk lane frees up or the pool stops **/
+    std::condition_variable_any work_cv;
+
+    /** Signalled when outstanding drops to zero **/
+    std::condition_variable_any idle_cv;
+
+    std::vector<std::thread> workers;
+
+    bool BulkRunnable() const {
+        return !ready_bulk.empty() && bulk_running < bulk_limit;
+    }
+
+    void MakeReady(Task task) {
+        std::map<Rank, Task>& queue = task.bulk ? ready_bulk : ready;
+        queue.emplace(Rank(task.priority, submitted++), std::move(task));
+    }
+
+    void Work() {
+        std::unique_lock<DFSMutex> lock(mutex);
+        while (true) {
+            work_cv.wait(lock, [this]{ return stopping || !ready.empty() || BulkRunnable(); });
+            if (ready.empty() && !BulkRunnable()) {
+                return;
+            }
+            std::map<Rank, Task>& queue = BulkRunnable() ? ready_bulk : ready;
+            Task task = std::move(queue.begin()->second);
+            queue.erase(queue.begin());
+            if (task.bulk) {
+                bulk_running++;
+            }
+
+            lock.unlock();
+            task.run();
+            lock.lock();
+
+            if (task.bulk) {
+                bulk_running--;
+                work_cv.notify_one();
+            }
+            // Hand the key to the next task waiting on it, if any
+            auto waiting = busy.find(task.key);
+            if (waiting->second.empty()) {
+                busy.erase(waiting);
+            } else {
+                MakeReady(std::move(waiting->second.front()));
+                waiting->second.pop_front();
+                work_cv.notify_one();
+            }
+            if (--outstanding == 0) {
+                idle_cv.notify_all();
+            }
+        }
+    }
+
+public:
+
+    /**
+     * @param threads how many workers to run
+     * @param bulk_threads how many of them may run bulk tasks at once. At least one always can
+     */
+    DFSTransferPool(std::size_t threads, std::size_t bulk_threads) :
+        submitted(0), bulk_limit(std::max<std::size_t>(bulk_threads, 1)), bulk_running(0), outstanding(0), stopping(false) {
+        for (std::size_t i = 0; i < std::max<std::size_t>(threads, 1); i++) {
+            workers.emplace_back(&DFSTransferPool::Work, this);
+        }
+    }
+
+    DFSTransferPool(const DFSTransferPool&) = delete;
+    DFSTransferPool& operator=(const DFSTransferPool&) = delete;
+
+    /** Finishes the tasks already ready, then stops the workers **/
+    ~DFSTransferPool() {
+        {
+            std::lock_guard<DFSMutex> lock(mutex);
+            stopping = true;
+        }
+        work_cv.notify_all();
+        for (std::thread& worker : workers) {
+            worker.join();
+        }
+    }
+
+    /**
+     * Queue a task. It runs once every earlier task with the same key has finished
+     *
+     * @param key
+     * @param run
+     * @param priority lower runs sooner
+     * @param bulk run it in the bulk lane
+     */
+    void Submit(const std::string& key, std::function<void()> run, std::uint64_t priority = 0, bool bulk = false) {
+        std::lock_guard<DFSMutex> lock(mutex);
+        outstanding++;
+        auto inserted = busy.emplace(key, std::deque<Task>());
+        if (!inserted.second) {
+            inserted.first->second.push_back({key, std::move(run), priority, bulk});
+            return;
+        }
+        MakeReady({key, std::move(run), priority, bulk});
+        work_cv.notify_one();
+    }
+
+    /** Block until every submitted task has finished **/
+    void Wait() {
+        std::unique_lock<DFSMutex> lock(mutex);
+        idle_cv.wait(lock, [this]{ return outstanding == 0; });
+    }
+
+    std::size_t Workers() const { return workers.size(); }
+};
+
+#endif //PR4_DFSLIBX_TRANSFER_POOL_H
@@ -0,0 +1,105 @@
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <iostream>
+
+#include <grpcpp/grpcpp.h>
+
+#include "../proto-src/dfs-service.grpc.pb.h"
+
+//
+// Scale check for the server's parked CallbackList calls. Parks a number of calls at the
+// server's current sequence, each as a client of its own, on one channel, then waits for a
+// change to release them and times how long it takes until every call is answered. Each
+// answer carries the full listing, which the server serializes once and shares among them.
+//
+// The change is made by whoever runs it, e.g. a store through dfs-client-p2 once "parked" is
+// printed; callback-fanout.sh sets up a server and does that. Fails unless every call is
+// answered with the same listing, one file longer than the one they were parked on.
+//
+// usage: callback-fanout <address> [calls]
+//
+
+namespace {
+
+struct Call {
+    grpc::ClientContext context;
+    dfs_service::Files reply;
+    grpc::Status status;
+    std::unique_ptr<grpc::ClientAsyncResponseReader<dfs_service::Files>> rpc;
+};
+
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        std::cerr << "usage: callback-fanout <address> [calls]" << std::endl;
+        return 2;
+    }
+    const int calls = argc > 2 ? std::atoi(argv[2]) : 2000;
+    auto stub = dfs_service::DFSService::NewStub(grpc::CreateChannel(argv[1], grpc::InsecureChannelCredentials()));
+
+    // A first call with no sequence is answered at once, with where the server is at
+    dfs_service::Files listing;
+    {
+        grpc::ClientContext context;
+        dfs_service::CallbackRequest request;
+        request.set_client_id("fanout-probe");
+        grpc::Status status = stub->CallbackList(&context, request, &listing);
+        if (!status.ok()) {
+            std::cerr << "FAILED: listing: " << status.error_message() << std::endl;
+            return 1;
+        }
+    }
+    std::cout << "sequence " << listing.sequence() << ", " << listing.file_size() << " files" << std::endl;
+
+    grpc::CompletionQueue queue;
+    std::vector<std::unique_ptr<Call>> parked;
+    for (int i = 0; i < calls; i++) {
+        parked.emplace_back(new Call);
+        Call* call = parked.back().get();
+        dfs_service::CallbackRequest request;
+        request.set_sequence(listing.sequence());
+        request.set_client_id("fanout-" + std::to_string(i));
+        call->context.set_deadline(std::chrono::system_clock::now() + std::chrono::seconds(120));
+        call->rpc = stub->AsyncCallbackList(&call->context, request, &queue);
+        call->rpc->Finish(&call->reply, &call->status, call);
+    }
+    std::cout << "parked " << calls << std::endl;
+
+    int answered = 0;
+    int failed = 0;
+    int mismatched = 0;
+    std::size_t bytes = 0;
+    std::chrono::steady_clock::time_point first;
+    void* tag;
+    bool ok;
+    while (answered < calls && queue.Next(&tag, &ok)) {
+        Call* call = static_cast<Call*>(tag);
+        if (answered++ == 0) {
+            first = std::chrono::steady_clock::now();
+        }
+        if (!call->status.ok()) {
+            failed++;
+            continue;
+        }
+        if (call->reply.file_size() != listing.file_size() + 1 || call->reply.sequence() <= listing.sequence()) {
+            mismatched++;
+        }
+        bytes += call->reply.ByteSizeLong();
+    }
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - first);
+    queue.Shutdown();
+    while (queue.Next(&tag, &ok)) {}
+
+    std::cout << answered << " answered over " << elapsed.count() << "ms after the first, " << failed << " failed, "
+        << mismatched << " with the wrong listing, " << bytes / std::max(answered - failed, 1) << " bytes each" << std::endl;
+    if (answered != calls || failed || mismatched) {
+        std::cerr << "FAILED" << std::endl;
+        return 1;
+    }
+    std::cout << "OK" << std::endl;
+    return 0;
+}
@@ -0,0 +1,53 @@
+#!/bin/bash
+#
+# Runs callback-fanout against a fresh server: a mount of some hundreds of files, the given
+# number of parked CallbackList calls, and a single store through dfs-client-p2 to release
+# them. Fails if the server reports a sanitizer error or any call goes unanswered.
+#
+# usage: tests/callback-fanout.sh [calls] [files], from part2 once make fanout has built it
+#
+
+CALLS=${1:-2000}
+FILES=${2:-500}
+BIN_DIR=${BIN_DIR:-../bin}
+ADDRESS=${ADDRESS:-127.0.0.1:42099}
+export ASAN_OPTIONS=detect_leaks=0
+
+WORK=$(mktemp -d)
+SERVER_PID=
+cleanup() {
+    [ -n "$SERVER_PID" ] && kill "$SERVER_PID" 2>/dev/null && wait "$SERVER_PID" 2>/dev/null
+    rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+mkdir "$WORK/server" "$WORK/client"
+for i in $(seq "$FILES"); do
+    echo "$i" > "$WORK/server/file-$i.txt"
+done
+
+# Hold calls for longer than the run takes, and publish the store at once
+"$BIN_DIR/dfs-server-p2" -a "$ADDRESS" -m "$WORK/server" -l 120000 -w 0 -t 0 > "$WORK/server.log" 2>&1 &
+SERVER_PID=$!
+sleep 0.5
+
+"$BIN_DIR/callback-fanout" "$ADDRESS" "$CALLS" > "$WORK/fanout.log" 2>&1 &
+FANOUT_PID=$!
+for attempt in $(seq 300); do
+    grep -q parked "$WORK/fanout.log" && break
+    sleep 0.1
+done
+# Let the calls reach the server before releasing them
+sleep 2
+
+echo released > "$WORK/client/released.txt"
+"$BIN_DIR/dfs-client-p2" -a "$ADDRESS" -m "$WORK/client" store released.txt > "$WORK/client.log" 2>&1
+
+wait "$FANOUT_PID"
+RESULT=$?
+cat "$WORK/fanout.log"
+if grep -q Sanitizer "$WORK/server.log"; then
+    cat "$WORK/server.log"
+    exit 1
+fi
+exit $RESULT
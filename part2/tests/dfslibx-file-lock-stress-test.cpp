@@ -0,0 +1,135 @@
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdlib>
+#include <iostream>
+#include <functional>
+
+#include "../src/dfslibx-transfer-pool.h"
+
+//
+// Stress test for the client's per-file serialization: file locks striped by name, as
+// DFSClientNodeP2::FileLock hands them out, with sync steps run on a DFSTransferPool keyed by
+// file name, while watcher threads update the same files directly.
+//
+// Every update is a read, a yield and a write of the file's counter under the file's stripe,
+// so any two updates of one file that overlapped would lose one of them. There are more files
+// than stripes, so unrelated files share stripes as they do on the client. At the end every
+// file must hold exactly the number of updates made to it, and the pool's updates of each file
+// must have run in the order they were submitted.
+//
+// usage: dfslibx-file-lock-stress-test [milliseconds] [threads]
+//
+
+namespace {
+
+// As DFS_CLIENT_FILE_LOCK_STRIPES
+constexpr std::size_t Stripes = 64;
+constexpr std::size_t Files = 200;
+
+struct FileLike {
+    std::uint64_t updates = 0;
+    // Submission numbers of the pool's updates, in the order they ran
+    std::vector<std::uint64_t> pooled;
+};
+
+void Check(bool condition, const std::string& what) {
+    if (!condition) {
+        std::cerr << "FAILED: " << what << std::endl;
+        std::exit(1);
+    }
+}
+
+}
+
+int main(int argc, char** argv) {
+    const auto duration = std::chrono::milliseconds(argc > 1 ? std::atoi(argv[1]) : 1000);
+    const int threads = argc > 2 ? std::atoi(argv[2]) : 8;
+
+    std::vector<DFSMutex> stripes(Stripes);
+    DFSLockClass& stripe_class = DFSLockClass::Named("file");
+    for (DFSMutex& stripe : stripes) {
+        stripe.SetLockClass(stripe_class);
+    }
+    std::vector<std::string> names;
+    for (std::size_t i = 0; i < Files; i++) {
+        names.push_back("file-" + std::to_string(i) + ".txt");
+    }
+    auto file_lock = [&](const std::string& name) -> DFSMutex& {
+        return stripes[std::hash<std::string>()(name) % Stripes];
+    };
+
+    std::vector<FileLike> files(Files);
+    auto update = [&](std::size_t file) {
+        FileLike& state = files[file];
+        std::uint64_t seen = state.updates;
+        std::this_thread::yield();
+        state.updates = seen + 1;
+    };
+
+    std::atomic<bool> stop(false);
+    std::atomic<std::uint64_t> direct(0);
+    std::vector<std::uint64_t> submitted(Files, 0);
+    {
+        DFSTransferPool pool(threads, threads / 4);
+
+        // The watcher: store-like updates straight from their own threads
+        std::vector<std::thread> watchers;
+        for (int t = 0; t < threads; t++) {
+            watchers.emplace_back([&, t] {
+                std::size_t file = t;
+                while (!stop) {
+                    file = (file * 31 + 7) % Files;
+                    std::lock_guard<DFSMutex> lock(file_lock(names[file]));
+                    update(file);
+                    direct++;
+                }
+            });
+        }
+
+        const auto start = std::chrono::steady_clock::now();
+        // The sync: batches of fetch-like updates queued on the pool, a few of them bulk. Each
+        // file is queued several times a batch, with falling priorities that the pool must not
+        // let reorder updates of one file
+        std::uint64_t round = 0;
+        while (!stop) {
+            for (std::size_t file = round % 3; file < Files; file += 3) {
+                for (std::uint64_t queued = 0; queued < 3; queued++) {
+                    std::uint64_t number = submitted[file]++;
+                    pool.Submit(names[file], [&, file, number] {
+                        std::lock_guard<DFSMutex> lock(file_lock(names[file]));
+                        update(file);
+                        files[file].pooled.push_back(number);
+                    }, 3 - queued, file % 17 == 0);
+                }
+            }
+            pool.Wait();
+            round++;
+            stop = std::chrono::steady_clock::now() - start >= duration;
+        }
+        for (std::thread& watcher : watchers) {
+            watcher.join();
+        }
+    }
+
+    std::uint64_t total = 0;
+    std::uint64_t pooled = 0;
+    for (std::size_t file = 0; file < Files; file++) {
+        const FileLike& state = files[file];
+        Check(state.pooled.size() == submitted[file], names[file] + " lost pool updates");
+        for (std::size_t i = 0; i < state.pooled.size(); i++) {
+            Check(state.pooled[i] == i, names[file] + " ran pool updates out of order");
+        }
+        total += state.updates;
+        pooled += state.pooled.size();
+    }
+    Check(total == pooled + direct, "lost updates: " + std::to_string(total) + " made, "
+        + std::to_string(pooled + direct) + " expected");
+
+    DFSLockClass::Snapshot stats = stripe_class.Take(0);
+    std::cout << "OK: " << direct << " direct and " << pooled << " pooled updates over " << Files
+        << " files, " << stats.contended << " contended stripe acquisitions" << std::endl;
+    return 0;
+}
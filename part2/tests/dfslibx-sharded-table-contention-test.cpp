@@ -0,0 +1,120 @@
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+
+#include "../src/dfslibx-sharded-table.h"
+
+//
+// Contention benchmark for DFSShardedTable. Each thread works on a file of its own, the way
+// requests for different files do on the server, and every operation looks the file up, takes
+// its lock and bumps a counter. The same run is made against a table with the server's 64
+// shards and one with a single shard, which is what a global map behind one lock amounts to.
+//
+// Two workloads are run on each: lookups of files whose state is kept, which only take the
+// shard shared, and churn, where every state is idle once released, so each operation inserts
+// and erases its entry under the shard's exclusive lock.
+//
+// Throughput and the number of contended shard lock acquisitions are printed for comparison.
+// Only correctness is checked, so the run passes on a single CPU, where nothing runs in
+// parallel and the two tables perform much the same.
+//
+// usage: dfslibx-sharded-table-contention-test [milliseconds] [threads]
+//
+
+namespace {
+
+// Whether released states are dropped, i.e. the churn workload is running
+std::atomic<bool> churn(false);
+
+struct FileLike {
+    explicit FileLike(const std::string& key) : access(DFSLockClass::Named("bench_file"), key), writes(0) {}
+    DFSSharedMutex access;
+    std::atomic<std::uint64_t> writes;
+    bool Idle() { return churn; }
+};
+
+void Check(bool condition, const std::string& what) {
+    if (!condition) {
+        std::cerr << "FAILED: " << what << std::endl;
+        std::exit(1);
+    }
+}
+
+std::uint64_t Contended(DFSLockClass& lock_class) {
+    return lock_class.Take(0).contended;
+}
+
+template <std::size_t Shards>
+void Run(const std::string& name, bool churning, int threads, std::chrono::milliseconds duration) {
+    DFSLockClass& lock_class = DFSLockClass::Named(name + (churning ? "_churn" : "_lookup"));
+    DFSShardedTable<FileLike, Shards> table(lock_class);
+    churn = churning;
+
+    std::atomic<bool> stop(false);
+    std::vector<std::uint64_t> done(threads, 0);
+    std::vector<std::thread> workers;
+    std::uint64_t contended_before = Contended(lock_class);
+    auto start = std::chrono::steady_clock::now();
+    for (int t = 0; t < threads; t++) {
+        workers.emplace_back([&, t] {
+            const std::string key = "file-" + std::to_string(t);
+            std::uint64_t ops = 0;
+            while (!stop) {
+                auto handle = table.FindOrInsert(key);
+                // Mostly reads, with a write now and then, like a mounted client's traffic
+                if (ops % 8 == 0) {
+                    std::lock_guard<DFSSharedMutex> lock(handle->access);
+                    handle->writes++;
+                } else {
+                    std::shared_lock<DFSSharedMutex> lock(handle->access);
+                }
+                ops++;
+            }
+            done[t] = ops;
+        });
+    }
+    std::this_thread::sleep_for(duration);
+    stop = true;
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::uint64_t total = 0;
+    for (int t = 0; t < threads; t++) {
+        total += done[t];
+        if (!churning) {
+            // Kept states have seen every write their thread made
+            auto handle = table.Find("file-" + std::to_string(t));
+            Check(static_cast<bool>(handle), "kept state missing for thread " + std::to_string(t));
+            Check(handle->writes == (done[t] + 7) / 8, "lost writes for thread " + std::to_string(t));
+        }
+    }
+    Check(table.Size() == (churning ? 0 : static_cast<std::size_t>(threads)),
+        "table holds " + std::to_string(table.Size()) + " entries after " + name);
+
+    std::cout << std::left << std::setw(8) << name << std::setw(8) << (churning ? "churn" : "lookup")
+        << std::right << std::setw(12) << static_cast<std::uint64_t>(total / seconds) << " ops/s"
+        << std::setw(12) << Contended(lock_class) - contended_before << " contended" << std::endl;
+}
+
+}
+
+int main(int argc, char** argv) {
+    const auto duration = std::chrono::milliseconds(argc > 1 ? std::atoi(argv[1]) : 500);
+    const int threads = argc > 2 ? std::atoi(argv[2]) : 64;
+
+    std::cout << threads << " threads on distinct files, " << duration.count() << "ms a run, "
+        << std::thread::hardware_concurrency() << " CPUs" << std::endl;
+    for (bool churning : {false, true}) {
+        Run<64>("sharded", churning, threads, duration);
+        Run<1>("single", churning, threads, duration);
+    }
+    std::cout << "OK" << std::endl;
+    return 0;
+}
@@ -0,0 +1,94 @@
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdlib>
+#include <iostream>
+
+#include "../src/dfslibx-sharded-table.h"
+
+//
+// Hammers one key of a DFSShardedTable with concurrent Find, FindOrInsert and handle
+// releases, so that last references are dropped, re-taken and the entry erased and
+// re-inserted all at once. Built with AddressSanitizer, a release that touches an entry
+// another thread already erased fails the run.
+//
+// The table has a single shard, and a second key whose state is slow to construct keeps
+// that shard locked exclusively now and then. Releases of the hot key pile up behind it
+// between their shared and exclusive locks, which is where the race is, even on one CPU.
+// Only a few threads take part, since a descheduled thread holding a reference keeps the
+// entry alive, and with many of them it would hardly ever be erased at all.
+//
+// usage: dfslibx-sharded-table-test [milliseconds] [threads]
+//
+
+namespace {
+
+struct Counted {
+    explicit Counted(const std::string& key) : key(key), uses(0) {
+        if (key == "slow") {
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+        }
+    }
+    std::string key;
+    std::atomic<std::size_t> uses;
+    bool Idle() { return true; }
+};
+
+void Check(bool condition, const std::string& what) {
+    if (!condition) {
+        std::cerr << "FAILED: " << what << std::endl;
+        std::exit(1);
+    }
+}
+
+}
+
+int main(int argc, char** argv) {
+    DFSShardedTable<Counted, 1> table(DFSLockClass::Named("test"));
+    const std::string key("hot");
+    const std::string slow("slow");
+    const int threads = argc > 2 ? std::atoi(argv[2]) : 4;
+    const auto duration = std::chrono::milliseconds(argc > 1 ? std::atoi(argv[1]) : 2000);
+
+    std::atomic<bool> stop(false);
+    std::atomic<std::uint64_t> rounds(0);
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; t++) {
+        workers.emplace_back([&, t] {
+            std::uint64_t round = 0;
+            while (!stop) {
+                if (t == 0) {
+                    table.FindOrInsert(slow);
+                } else if ((round + t) % 3 == 0) {
+                    auto handle = table.Find(key);
+                    if (handle) {
+                        Check(handle->key == key, "found entry has the wrong key");
+                        handle->uses++;
+                    }
+                } else {
+                    auto handle = table.FindOrInsert(key);
+                    Check(static_cast<bool>(handle), "FindOrInsert returned an empty handle");
+                    Check(handle->key == key, "inserted entry has the wrong key");
+                    handle->uses++;
+                    if (round % 2 == 0) {
+                        handle.Reset();
+                    }
+                }
+                round++;
+            }
+            rounds += round;
+        });
+    }
+    std::this_thread::sleep_for(duration);
+    stop = true;
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+
+    Check(table.Size() == 0, "idle entry left in the table, size " + std::to_string(table.Size()));
+    Check(!table.Find(key), "idle entry still found");
+    std::cout << "OK: " << rounds << " rounds over " << threads << " threads" << std::endl;
+    return 0;
+}